@@ -33,7 +33,8 @@ then
 If --install-jellyfish is specified, the source code for version 1.1
 is downloaded from http://www.cbcb.umd.edu/software/jellyfish and installed 
 in KRAKEN_DIR. Note that this may overwrite other jellyfish installation in 
-the same path."
+the same path. Jellyfish is only needed for krakenhll-build --jellyfish
+and --max-db-size."
   exit 64
 fi
 
@@ -55,7 +55,6 @@ script_dir=`dirname $0`
 
 DATABASE_DIR="$KRAKEN_DB_NAME"
 FIND_OPTS=-L
-JELLYFISH_BIN=`$script_dir/krakenhll-check_for_jellyfish.sh`
 NCBI_SERVER="ftp.ncbi.nih.gov"
 FTP_SERVER="ftp://$NCBI_SERVER"
 
@@ -75,6 +74,25 @@ else
   echo "Kraken build set to minimize RAM usage."
 fi
 
+SORT_MEMORY_FLAG=""
+if [ -n "$KRAKEN_SORT_MEMORY" ]
+then
+  SORT_MEMORY_FLAG="-m $KRAKEN_SORT_MEMORY"
+fi
+
+# Database reduction works on the unsorted Jellyfish k-mer set
+USE_JELLYFISH=0
+if [ "$KRAKEN_USE_JELLYFISH" == "1" ] || [ -n "$KRAKEN_MAX_DB_SIZE" ]
+then
+  USE_JELLYFISH=1
+fi
+
+LCA_CHUNK_FLAG=""
+if [ -n "$KRAKEN_LCA_CHUNK_SIZE" ]
+then
+  LCA_CHUNK_FLAG="-s $KRAKEN_LCA_CHUNK_SIZE"
+fi
+
 if [ "$KRAKEN_REBUILD_DATABASE" == "1" ]
 then
   rm -f database.* *.map lca.complete library-files.txt uid_database.* taxDB
@@ -113,10 +131,22 @@ echo "Found $N_FILES sequence files (*.{fna,fa,ffn}) in the library directory."
 if [ -e "database.jdb" ] || [ -e "database0.kdb" ]
 then
   echo "Skipping step 1, k-mer set already exists."
+elif [ "$USE_JELLYFISH" != "1" ]
+then
+  echo "Creating sorted k-mer set (steps 1 and 3 of 6)..."
+  start_time1=$(date "+%s.%N")
+  db_build $SORT_MEMORY_FLAG -t $KRAKEN_THREAD_CT -k $KRAKEN_KMER_LEN -n $KRAKEN_MINIMIZER_LEN \
+    -o database0.kdb.tmp -i database.idx <( cat_library )
+
+  # Once here, DB is sorted, can put file in proper place.
+  mv database0.kdb.tmp database0.kdb
+
+  echo "Sorted k-mer set created. [$(report_time_elapsed $start_time1)]"
 else
   echo "Creating k-mer set (step 1 of 6)..."
   start_time1=$(date "+%s.%N")
 
+  JELLYFISH_BIN=`$script_dir/krakenhll-check_for_jellyfish.sh`
   echo "Using $JELLYFISH_BIN"
   [[ "$JELLYFISH_BIN" != "" ]] || exit 1
   # Estimate hash size as 1.15 * chars in library FASTA files
@@ -194,7 +224,7 @@ then
 else
   echo "Sorting k-mer set (step 3 of 6)..."
   start_time1=$(date "+%s.%N")
-  db_sort -z $MEMFLAG -t $KRAKEN_THREAD_CT -n $KRAKEN_MINIMIZER_LEN \
+  db_sort -z $MEMFLAG $SORT_MEMORY_FLAG -t $KRAKEN_THREAD_CT -n $KRAKEN_MINIMIZER_LEN \
     -d database.jdb -o $SORTED_DB_NAME.tmp \
     -i database.idx
 
@@ -253,7 +283,7 @@ if [ "$KRAKEN_LCA_DATABASE" != "0" ]; then
     fi
     start_time1=$(date "+%s.%N")
     set -x
-      set_lcas $MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
+      set_lcas $MEMFLAG $LCA_CHUNK_FLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
       -b taxDB $PARAM -t $KRAKEN_THREAD_CT -m seqid2taxid.map -c database.kdb.counts \
       -F <( cat_library ) -T > seqid2taxid-plus.map
     set +x
@@ -291,7 +321,7 @@ if [ "$KRAKEN_UID_DATABASE" != "0" ]; then
       fi
     fi
     start_time1=$(date "+%s.%N")
-      set_lcas $MEMFLAG -x -d $SORTED_DB_NAME -I uid_to_taxid.map -o uid_database.kdb -i database.idx -v \
+      set_lcas $MEMFLAG $LCA_CHUNK_FLAG -x -d $SORTED_DB_NAME -I uid_to_taxid.map -o uid_database.kdb -i database.idx -v \
         -b taxDB $PARAM -t $KRAKEN_THREAD_CT -m seqid2taxid.map -c uid_database.kdb.counts -F <( cat_library )
   
     echo "UID Database created. [$(report_time_elapsed $start_time1)]"
@@ -73,4 +73,77 @@ sub find_db {
   return $db_prefix;
 }
 
+# Input: name of a file with per-read Kraken output, in the text format or
+#   the binary format written by 'classify -b' (read IDs in FILE.ids), or
+#   '-' for text output on STDIN
+# Returns: an iterator that yields the output line by line in the text
+#   format, and undef at the end of the file.
+# The file is read only once, so that pipes work as well: the bytes read to
+# check for the binary format are put back in front of the first text line.
+sub kraken_output_reader {
+  my $filename = shift;
+  my $fh;
+  if ($filename eq "-") {
+    $fh = \*STDIN;
+  } else {
+    open $fh, "<", $filename
+      or die "can't open $filename: $!\n";
+  }
+  binmode $fh;
+  my $header;
+  defined(read($fh, $header, 16))
+    or die "can't read $filename: $!\n";
+  if (length($header) < 16 || substr($header, 0, 8) ne "KRAKBIN1") {
+    my $pending = $header;
+    return sub {
+      return scalar <$fh> unless length $pending;
+      my $nl = index($pending, "\n");
+      if ($nl < 0) {
+        my $rest = <$fh>;
+        $pending .= $rest if defined $rest;
+        $nl = index($pending, "\n");
+      }
+      my $line = $nl < 0 ? $pending : substr($pending, 0, $nl + 1);
+      $pending = substr($pending, length $line);
+      return $line;
+    };
+  }
+  die "can't read binary Kraken output from STDIN, its read IDs are in a separate file\n"
+    if $filename eq "-";
+
+  my $flags = unpack("L", substr($header, 8, 4));
+  my $has_hitlists = $flags & 1;
+  my $is_quick = $flags & 2;
+  open my $ids_fh, "<", "$filename.ids"
+    or die "can't open $filename.ids: $!\n";
+  return sub {
+    my $record;
+    return undef unless read($fh, $record, 16) == 16;
+    my ($taxid, $len, $n_runs, $n_hits) = unpack("L4", $record);
+    my $seqid = <$ids_fh>;
+    die "more records in $filename than read IDs in $filename.ids\n"
+      unless defined $seqid;
+    chomp $seqid;
+    my $hit_list;
+    if ($is_quick) {
+      $hit_list = "Q:$n_hits";
+    } elsif (!$has_hitlists) {
+      $hit_list = "NA";
+    } elsif ($n_runs == 0) {
+      $hit_list = "0:0";
+    } else {
+      my $runs;
+      read($fh, $runs, 8 * $n_runs) == 8 * $n_runs
+        or die "truncated record in $filename\n";
+      my @runs = unpack("L*", $runs);
+      my @hits;
+      while (my ($run_taxid, $count) = splice(@runs, 0, 2)) {
+        push @hits, ($run_taxid == 0xffffffff ? "A" : $run_taxid) . ":$count";
+      }
+      $hit_list = join(" ", @hits);
+    }
+    return join("\t", $taxid ? "C" : "U", $seqid, $taxid, $len, $hit_list) . "\n";
+  };
+}
+
 1;
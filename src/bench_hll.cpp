@@ -0,0 +1,130 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hyperloglogplus.hpp"
+#include <iostream>
+#include <random>
+#include <chrono>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+int usage(int exit_code) {
+  std::cerr <<
+"bench_hll: Time merging and estimation of dense HyperLogLog sketches\n"
+"\n"
+"Usage: bench_hll OPTIONS\n"
+"\n"
+"OPTIONS:\n"
+"  -p PRECISION   Precision in range of 10 to 18 (default: 14)\n"
+"  -n INT         Number of sketches (default: 1000)\n"
+"  -c INT         Number of random values per sketch (default: 100000)\n"
+"  -i INT         Number of iterations (default: 10)\n"
+"  -P             Use packed 6-bit registers\n"
+"\n"
+"Each operation is timed with the scalar and, if available, the AVX2 kernels.\n";
+  return exit_code;
+}
+
+struct Timings {
+  double merge_ms, ertl_ms, heule_ms;
+  uint64_t merged_estimate, estimate_sum;
+};
+
+double elapsed_ms(chrono::steady_clock::time_point start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+Timings run_benchmark(const vector<HyperLogLogPlusMinus<uint64_t> >& sketches, size_t p, size_t iterations) {
+  Timings t = {0, 0, 0, 0, 0};
+  for (size_t it = 0; it < iterations; ++it) {
+    auto start = chrono::steady_clock::now();
+    HyperLogLogPlusMinus<uint64_t> merged(p);
+    for (const auto& hll : sketches)
+      merged += hll;
+    t.merge_ms += elapsed_ms(start);
+    t.merged_estimate = merged.ertlCardinality();
+
+    start = chrono::steady_clock::now();
+    t.estimate_sum = 0;
+    for (const auto& hll : sketches)
+      t.estimate_sum += hll.ertlCardinality();
+    t.ertl_ms += elapsed_ms(start);
+
+    start = chrono::steady_clock::now();
+    for (const auto& hll : sketches)
+      t.estimate_sum += hll.heuleCardinality();
+    t.heule_ms += elapsed_ms(start);
+  }
+  return t;
+}
+
+void print_timings(const char* kernels, const Timings& t, size_t iterations) {
+  cout << kernels << '\t' << t.merge_ms / iterations << '\t' << t.ertl_ms / iterations
+       << '\t' << t.heule_ms / iterations << '\t' << t.merged_estimate << '\n';
+}
+
+int main(int argc, char **argv) {
+  size_t p = 14;
+  size_t n_sketches = 1000;
+  size_t cardinality = 100000;
+  size_t iterations = 10;
+
+  int c;
+  while ((c = getopt(argc, argv, "p:n:c:i:Ph")) != -1) {
+    switch (c) {
+      case 'p': p = stoi(optarg); break;
+      case 'n': n_sketches = stoi(optarg); break;
+      case 'c': cardinality = stoi(optarg); break;
+      case 'i': iterations = stoi(optarg); break;
+      case 'P': hll_use_packed_registers(true); break;
+      case 'h': return usage(0);
+      default: return usage(1);
+    }
+  }
+  if (p < 10 || p > 18 || iterations == 0)
+    return usage(1);
+
+  std::mt19937_64 gen(42);
+  vector<HyperLogLogPlusMinus<uint64_t> > sketches(n_sketches, HyperLogLogPlusMinus<uint64_t>(p, false));
+  for (auto& hll : sketches) {
+    hll.use_n_observed = false;
+    for (size_t i = 0; i < cardinality; ++i)
+      hll.add(gen());
+  }
+
+  cout << "kernels\tmerge_ms\tertl_ms\theule_ms\tmerged_estimate\n";
+  hll_use_simd_kernels(false);
+  Timings scalar = run_benchmark(sketches, p, iterations);
+  print_timings("scalar", scalar, iterations);
+
+  if (hll_use_simd_kernels(true)) {
+    Timings simd = run_benchmark(sketches, p, iterations);
+    print_timings("avx2", simd, iterations);
+    if (simd.merged_estimate != scalar.merged_estimate || simd.estimate_sum != scalar.estimate_sum) {
+      cerr << "Estimates of scalar and AVX2 kernels differ!" << endl;
+      return 1;
+    }
+  } else {
+    cerr << "AVX2 kernels are not available." << endl;
+  }
+  return 0;
+}
@@ -27,6 +27,7 @@
 #include "taxdb.hpp"
 #include "gzstream.h"
 #include "uid_mapping.hpp"
+#include "kraken_output.hpp"
 #include <sstream>
 
 const size_t DEF_WORK_UNIT_SIZE = 500000;
@@ -38,17 +39,21 @@ using namespace kraken;
 void parse_command_line(int argc, char **argv);
 void usage(int exit_code=EX_USAGE);
 void process_file(char *filename);
-bool classify_sequence(DNASequence &dna, ostringstream &koss,
-                       ostringstream &coss, ostringstream &uoss,
+bool classify_sequence(DNASequence &dna, string &kbuf, string &ibuf,
+                       string &cbuf, string &ubuf,
                        unordered_map<uint32_t, ReadCounts>&);
-inline void print_sequence(ostringstream* oss_ptr, const DNASequence& dna);
-string hitlist_string(const vector<uint32_t> &taxa, const vector<char>& ambig_list);
+inline void print_sequence(string &buf, const DNASequence& dna);
+void append_hitlist_string(string &buf, const vector<uint32_t> &taxa, const vector<uint8_t> &ambig);
+void append_binary_record(string &buf, uint32_t call, uint32_t seq_len, uint32_t hits,
+                          const vector<uint32_t> &taxa, const vector<uint8_t> &ambig);
 
 
 set<uint32_t> get_ancestry(uint32_t taxon);
 void report_stats(struct timeval time1, struct timeval time2);
 double get_seconds(struct timeval time1, struct timeval time2);
+void merge_taxon_counts();
 unordered_map<uint32_t, ReadCounts> taxon_counts; // stats per taxon
+vector< unordered_map<uint32_t, ReadCounts> > Thread_taxon_counts; // stats per taxon of each thread
 
 int Num_threads = 1;
 vector<string> DB_filenames;
@@ -59,6 +64,10 @@ bool Print_classified = false;
 bool Print_unclassified = false;
 bool Print_kraken = true;
 bool Print_kraken_report = false;
+bool Binary_kraken_output = false;
+bool Binary_output_hitlists = true;
+bool Exact_kmer_counts = false;
+bool Count_unmatched_kmers = true;
 bool Populate_memory = false;
 bool Only_classified_kraken_output = false;
 bool Print_sequence = false;
@@ -72,11 +81,14 @@ QuickFile UID_to_TaxID_map_file;
 
 uint32_t Minimum_hit_count = 1;
 unordered_map<uint32_t, uint32_t> Parent_map;
-unordered_map<uint32_t, vector<uint32_t> > Uid_dict;
+TaxonomyTree Taxonomy;
+UidTaxidTable Uid_taxids;
 string Classified_output_file, Unclassified_output_file, Kraken_output_file, Report_output_file, TaxDB_file;
+string Read_counts_file;
 ostream *Classified_output;
 ostream *Unclassified_output;
 ostream *Kraken_output;
+ostream *Read_id_output;
 ostream *Report_output;
 vector<ofstream*> Open_fstreams;
 vector<ogzstream*> Open_gzstreams;
@@ -84,6 +96,30 @@ size_t Work_unit_size = DEF_WORK_UNIT_SIZE;
 TaxonomyDB<uint32_t> taxdb;
 static vector<KrakenDB*> KrakenDatabases (DB_filenames.size());
 
+// Marks the positions of the k-mers found in a database, for exact unique
+// k-mer counts
+struct KmerBitmap {
+  KmerBitmap(KrakenDB &db) : pair_ptr(db.get_pair_ptr()), key_len(db.get_key_len()),
+    pair_size(db.pair_size()), bits((db.get_key_ct() + 63) / 64, 0) {}
+
+  void mark(const uint32_t *val_ptr) {
+    uint64_t pos = ((const char *) val_ptr - pair_ptr - key_len) / pair_size;
+    uint64_t mask = (uint64_t)1 << (pos % 64);
+    uint64_t *word = &bits[pos / 64];
+    // Other threads may set bits of the word at the same time, so it is
+    // read and written atomically; the read skips the write of set bits
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & mask))
+      __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+  }
+
+  const char *pair_ptr;
+  uint64_t key_len;
+  uint64_t pair_size;
+  vector<uint64_t> bits;
+};
+vector<KmerBitmap> Kmer_bitmaps;
+void set_exact_kmer_counts();
+
 struct db_status {
   db_status() : current_bin_key(0), current_min_pos(1), current_max_pos(0) {}
   uint64_t current_bin_key;
@@ -139,6 +175,8 @@ int main(int argc, char **argv) {
   #endif
 
   parse_command_line(argc, argv);
+  if (Exact_kmer_counts)
+    HLL_PRECISION = 0;
   
   if (Map_UIDs) {
     if (DB_filenames.size() > 1) {
@@ -153,6 +191,8 @@ int main(int argc, char **argv) {
     //if (Populate_memory) {
     UID_to_TaxID_map_file.load_file();
     //}
+    Uid_taxids = UidTaxidTable(UID_to_TaxID_map_file.ptr(), UID_to_TaxID_map_file.size());
+    cerr << "Got " << Uid_taxids.size() << " UIDs." << endl;
   }
 
   if (Populate_memory)
@@ -181,6 +221,11 @@ int main(int argc, char **argv) {
   // TODO: Check all databases have the same k
   KmerScanner::set_k(KrakenDatabases[0]->get_k());
 
+  if (Exact_kmer_counts) {
+    for (size_t i = 0; i < KrakenDatabases.size(); ++i)
+      Kmer_bitmaps.push_back(KmerBitmap(*KrakenDatabases[i]));
+  }
+
   if (Populate_memory)
     cerr << "\ncomplete." << endl;
 
@@ -189,6 +234,7 @@ int main(int argc, char **argv) {
     // TODO: Define if the taxDB has read counts or not!!
       taxdb = TaxonomyDB<uint32_t>(TaxDB_file, false);
       Parent_map = taxdb.getParentMap();
+      Taxonomy = TaxonomyTree(Parent_map);
   } else {
       cerr << "TaxDB argument is required!" << endl;
       return 1;
@@ -215,16 +261,49 @@ int main(int argc, char **argv) {
     Kraken_output = &cout;
   }
 
+  if (Binary_kraken_output && Print_kraken) {
+    if (Kraken_output_file.empty() || ends_with(Kraken_output_file, ".gz")) {
+      cerr << "Binary Kraken output requires an uncompressed output file (option -o)!" << endl;
+      return 1;
+    }
+    if (Print_sequence)
+      cerr << "Read sequences are not included in binary Kraken output - ignoring -s." << endl;
+    cerr << "Writing read IDs to " << Kraken_output_file << ".ids" << endl;
+    Read_id_output = cout_or_file(Kraken_output_file + ".ids");
+
+    BinaryOutputHeader header;
+    memcpy(header.magic, KRAKEN_BINARY_OUTPUT_STRING, sizeof(header.magic));
+    header.flags = (Binary_output_hitlists && !Quick_mode ? BINARY_OUTPUT_HITLISTS : 0) |
+                   (Quick_mode ? BINARY_OUTPUT_QUICK : 0);
+    header.reserved = 0;
+    Kraken_output->write((const char *) &header, sizeof(header));
+  }
+
   //cerr << "Print_kraken: " << Print_kraken << "; Print_kraken_report: " << Print_kraken_report << "; k: " << uint32_t(KrakenDatabases[0]->get_k()) << endl;
 
   struct timeval tv1, tv2;
   gettimeofday(&tv1, NULL);
+  Thread_taxon_counts.resize(Num_threads);
   for (int i = optind; i < argc; i++)
     process_file(argv[i]);
+  merge_taxon_counts();
+  if (Exact_kmer_counts)
+    set_exact_kmer_counts();
   gettimeofday(&tv2, NULL);
 
   report_stats(tv1, tv2);
 
+  if (!Read_counts_file.empty()) {
+    std::cerr << "Writing taxon counts and k-mer sketches to " << Read_counts_file << " ..\n";
+    ofstream ofs(Read_counts_file.c_str(), std::ios::binary);
+    if (!ofs)
+      err(EX_CANTCREAT, "unable to open %s", Read_counts_file.c_str());
+    write_read_counts(ofs, taxon_counts, Exact_kmer_counts ? READ_COUNTS_EXACT : 0);
+    ofs.close();
+    if (!ofs)
+      err(EX_IOERR, "error writing %s", Read_counts_file.c_str());
+  }
+
   if (!Report_output_file.empty() && Report_output_file != "off") {
     gettimeofday(&tv1, NULL);
     std::cerr << "Writing report file to " << Report_output_file <<"  ..\n";
@@ -254,7 +333,7 @@ int main(int argc, char **argv) {
      Report_output = cout_or_file(Report_output_file);
   
     TaxReport<uint32_t,ReadCounts> rep = TaxReport<uint32_t, ReadCounts>(*Report_output, taxdb, taxon_counts, false);
-    if (HLL_PRECISION > 0) {
+    if (HLL_PRECISION > 0 || Exact_kmer_counts) {
       if (full_report) {
         rep.setReportCols(vector<string> {
           "%",
@@ -351,7 +430,10 @@ void process_file(char *filename) {
   #pragma omp parallel
   {
     vector<DNASequence> work_unit;
-    ostringstream kraken_output_ss, classified_output_ss, unclassified_output_ss;
+    // per-thread output buffers, reused across work units
+    string kraken_output_buf, read_id_buf, classified_output_buf, unclassified_output_buf;
+    // per-thread taxon counts, merged after all files are processed
+    unordered_map<uint32_t, ReadCounts>& my_taxon_counts = Thread_taxon_counts[omp_get_thread_num()];
 
     while (reader->is_valid()) {
       work_unit.clear();
@@ -369,31 +451,30 @@ void process_file(char *filename) {
       if (total_nt == 0)
         break;
       
-      unordered_map<uint32_t, ReadCounts> my_taxon_counts;
       uint64_t my_total_classified = 0;
-      kraken_output_ss.str("");
-      classified_output_ss.str("");
-      unclassified_output_ss.str("");
+      kraken_output_buf.clear();
+      read_id_buf.clear();
+      classified_output_buf.clear();
+      unclassified_output_buf.clear();
       for (size_t j = 0; j < work_unit.size(); j++) {
         my_total_classified += 
-            classify_sequence( work_unit[j], kraken_output_ss,
-                           classified_output_ss, unclassified_output_ss,
+            classify_sequence( work_unit[j], kraken_output_buf, read_id_buf,
+                           classified_output_buf, unclassified_output_buf,
                            my_taxon_counts);
       }
 
       #pragma omp critical(write_output)
       {
         total_classified += my_total_classified;
-        for (auto it = my_taxon_counts.begin(); it != my_taxon_counts.end(); ++it) {
-          taxon_counts[it->first] += std::move(it->second);
-        }
 
         if (Print_kraken)
-          (*Kraken_output) << kraken_output_ss.str();
+          Kraken_output->write(kraken_output_buf.data(), kraken_output_buf.size());
+        if (Print_kraken && Binary_kraken_output)
+          Read_id_output->write(read_id_buf.data(), read_id_buf.size());
         if (Print_classified)
-          (*Classified_output) << classified_output_ss.str();
+          Classified_output->write(classified_output_buf.data(), classified_output_buf.size());
         if (Print_unclassified)
-          (*Unclassified_output) << unclassified_output_ss.str();
+          Unclassified_output->write(unclassified_output_buf.data(), unclassified_output_buf.size());
         total_sequences += work_unit.size();
         total_bases += total_nt;
         //if (Print_Progress && total_sequences % 100000 < work_unit.size()) 
@@ -408,43 +489,79 @@ void process_file(char *filename) {
 }
 
 
-inline void print_sequence(ostringstream* oss_ptr, const DNASequence& dna) {
-      if (Fastq_input) {
-        (*oss_ptr) << "@" << dna.header_line << endl
-            << dna.seq << endl
-            << "+" << endl
-            << dna.quals << endl;
-      }
-      else {
-        (*oss_ptr) << ">" << dna.header_line << endl
-            << dna.seq << endl;
+// Count the marked database positions per taxon. Only k-mers found in a
+// database are marked, so taxon 0 gets no unique k-mers.
+void set_exact_kmer_counts() {
+  unordered_map<uint32_t, uint64_t> unique_counts;
+  for (size_t i = 0; i < Kmer_bitmaps.size(); ++i) {
+    const KmerBitmap &bitmap = Kmer_bitmaps[i];
+    #pragma omp parallel
+    {
+      unordered_map<uint32_t, uint64_t> my_unique_counts;
+      #pragma omp for schedule(static)
+      for (size_t w = 0; w < bitmap.bits.size(); ++w) {
+        uint64_t word = bitmap.bits[w];
+        while (word) {
+          uint64_t pos = w * 64 + __builtin_ctzll(word);
+          word &= word - 1;
+          uint32_t taxon = *(const uint32_t *)(bitmap.pair_ptr + pos * bitmap.pair_size + bitmap.key_len);
+          ++my_unique_counts[taxon];
+        }
       }
+      #pragma omp critical(merge_unique_counts)
+      for (auto it = my_unique_counts.begin(); it != my_unique_counts.end(); ++it)
+        unique_counts[it->first] += it->second;
+    }
+  }
+  for (auto it = unique_counts.begin(); it != unique_counts.end(); ++it)
+    taxon_counts[it->first].n_unique_kmers = it->second;
 }
 
-/*
-inline
-void append_hitlist_string(string& hitlist_string, uint32_t& last_taxon, uint32_t& last_counter, uint32_t current_taxon) {
-  if (last_taxon == current_taxon) {
-    ++last_counter;
-  } else {
-    if (last_counter > 0) {
-      if (last_taxon == ambig_taxon) {
-        hitlist_string += "A:" + std::to_string(last_counter) + ' ';
-      } else {
-        hitlist_string += std::to_string(last_taxon) + ':' + std::to_string(last_counter) + ' ';
+// Merge the per-thread taxon counts into taxon_counts. Pairs of maps are
+// merged in parallel, halving the number of maps in each round.
+void merge_taxon_counts() {
+  size_t n_maps = Thread_taxon_counts.size();
+  for (size_t stride = 1; stride < n_maps; stride *= 2) {
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < n_maps - stride; i += 2 * stride) {
+      unordered_map<uint32_t, ReadCounts>& dest = Thread_taxon_counts[i];
+      unordered_map<uint32_t, ReadCounts>& src = Thread_taxon_counts[i + stride];
+      for (auto it = src.begin(); it != src.end(); ++it) {
+        dest[it->first] += std::move(it->second);
       }
+      src.clear();
     }
-    last_counter = 1;
-    last_taxon = current_taxon;
+  }
+  if (n_maps > 0) {
+    taxon_counts = std::move(Thread_taxon_counts[0]);
+    Thread_taxon_counts[0].clear();
   }
 }
-*/
 
-string hitlist_string(const vector<uint32_t> &taxa, const vector<uint8_t> &ambig)
+inline void print_sequence(string &buf, const DNASequence& dna) {
+      if (Fastq_input) {
+        buf += '@';
+        buf += dna.header_line;
+        buf += '\n';
+        buf += dna.seq;
+        buf += "\n+\n";
+        buf += dna.quals;
+        buf += '\n';
+      }
+      else {
+        buf += '>';
+        buf += dna.header_line;
+        buf += '\n';
+        buf += dna.seq;
+        buf += '\n';
+      }
+}
+
+// Append the run-length encoded hit list, e.g. "562:13 A:2 0:5", to buf
+void append_hitlist_string(string &buf, const vector<uint32_t> &taxa, const vector<uint8_t> &ambig)
 {
   int64_t last_code;
-  int code_count = 1;
-  ostringstream hitlist;
+  uint64_t code_count = 1;
 
   if (ambig[0])   { last_code = -1; }
   else            { last_code = taxa[0]; }
@@ -458,23 +575,59 @@ string hitlist_string(const vector<uint32_t> &taxa, const vector<uint8_t> &ambig
       code_count++;
     }
     else {
-      if (last_code >= 0) {
-        hitlist << last_code << ":" << code_count << " ";
-      }
-      else {
-        hitlist << "A:" << code_count << " ";
-      }
+      if (last_code >= 0)
+        append_uint(buf, last_code);
+      else
+        buf += 'A';
+      buf += ':';
+      append_uint(buf, code_count);
+      buf += ' ';
       code_count = 1;
       last_code = code;
     }
   }
-  if (last_code >= 0) {
-    hitlist << last_code << ":" << code_count;
-  }
-  else {
-    hitlist << "A:" << code_count;
+  if (last_code >= 0)
+    append_uint(buf, last_code);
+  else
+    buf += 'A';
+  buf += ':';
+  append_uint(buf, code_count);
+}
+
+// Append a binary record for the read, followed by the run-length encoded
+// hit list (see kraken_output.hpp)
+void append_binary_record(string &buf, uint32_t call, uint32_t seq_len, uint32_t hits,
+                          const vector<uint32_t> &taxa, const vector<uint8_t> &ambig)
+{
+  BinaryReadRecord record;
+  record.taxid = call;
+  record.seq_len = seq_len;
+  record.n_runs = 0;
+  record.n_hits = hits;
+
+  size_t record_pos = buf.size();
+  append_raw(buf, record);
+  if (!Binary_output_hitlists || Quick_mode || taxa.empty())
+    return;
+
+  BinaryHitRun run;
+  run.taxid = ambig[0] ? AMBIGUOUS_TAXON : taxa[0];
+  run.count = 1;
+  for (size_t i = 1; i < taxa.size(); i++) {
+    uint32_t code = ambig[i] ? AMBIGUOUS_TAXON : taxa[i];
+    if (code == run.taxid) {
+      run.count++;
+    }
+    else {
+      append_raw(buf, run);
+      record.n_runs++;
+      run.taxid = code;
+      run.count = 1;
+    }
   }
-  return hitlist.str();
+  append_raw(buf, run);
+  record.n_runs++;
+  memcpy(&buf[record_pos], &record, sizeof(record));
 }
 
 /*
@@ -511,12 +664,13 @@ string hitlist_string_depr(const vector<uint32_t> &taxa)
 }
 */
 
-bool classify_sequence(DNASequence &dna, ostringstream &koss,
-                       ostringstream &coss, ostringstream &uoss,
+bool classify_sequence(DNASequence &dna, string &kbuf, string &ibuf,
+                       string &cbuf, string &ubuf,
                        unordered_map<uint32_t, ReadCounts>& my_taxon_counts) {
   vector<uint32_t> taxa;
   vector<uint8_t> ambig_list;
-  unordered_map<uint32_t, uint32_t> hit_counts;
+  vector<pair<uint32_t, uint64_t> > taxon_kmers;  // (taxon, k-mer) of each unambiguous k-mer
+  TaxonHitCounts hit_counts;
   uint64_t *kmer_ptr;
   uint32_t taxon = 0;
   uint32_t hits = 0;  // only maintained if in quick mode
@@ -531,6 +685,7 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
     size_t n_kmers = dna.seq.size()-KrakenDatabases[0]->get_k()+1;
     taxa.reserve(n_kmers);
     ambig_list.reserve(n_kmers);
+    taxon_kmers.reserve(n_kmers);
     KmerScanner scanner(dna.seq);
     while ((kmer_ptr = scanner.next_kmer()) != NULL) {
       taxon = 0;
@@ -548,15 +703,17 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
             &db_statuses[i].current_min_pos, &db_statuses[i].current_max_pos);
           if (val_ptr) {
             taxon = *val_ptr;
+            if (Exact_kmer_counts)
+              Kmer_bitmaps[i].mark(val_ptr);
             break;
           }
         }
 
         // cerr << "taxon for " << *kmer_ptr << " is " << taxon << endl;
-        my_taxon_counts[taxon].add_kmer(cannonical_kmer);
+        if (taxon || Count_unmatched_kmers)
+          taxon_kmers.push_back(make_pair(taxon, cannonical_kmer));
 
         if (taxon) {
-          hit_counts[taxon]++;
           if (Quick_mode && ++hits >= Minimum_hit_count)
             break;
         }
@@ -566,65 +723,88 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
     }
   }
 
+  // Group the k-mers by taxon, then count the hits and add the k-mers to
+  // the taxon's counter in one batch per taxon instead of once per k-mer
+  sort(taxon_kmers.begin(), taxon_kmers.end(),
+      [](const pair<uint32_t, uint64_t> &a, const pair<uint32_t, uint64_t> &b) {
+        return a.first < b.first;
+      });
+  vector<uint64_t> sorted_kmers(taxon_kmers.size());
+  for (size_t i = 0; i < taxon_kmers.size(); ++i)
+    sorted_kmers[i] = taxon_kmers[i].second;
+  for (size_t i = 0; i < taxon_kmers.size(); ) {
+    uint32_t kmer_taxon = taxon_kmers[i].first;
+    size_t j = i;
+    while (j < taxon_kmers.size() && taxon_kmers[j].first == kmer_taxon)
+      ++j;
+    my_taxon_counts[kmer_taxon].add_kmers(&sorted_kmers[i], j - i);
+    if (kmer_taxon)
+      hit_counts.push_back(make_pair(kmer_taxon, (uint32_t)(j - i)));
+    i = j;
+  }
+
   uint32_t call = 0;
   if (Map_UIDs) {
     if (Quick_mode) {
       cerr << "Quick mode not available when mapping UIDs" << endl;
       exit(1);
     } else {
-      call = resolve_uids3(hit_counts, Parent_map, Uid_dict,
-        UID_to_TaxID_map_file.ptr(), UID_to_TaxID_map_file.size());
+      call = resolve_uids4(hit_counts, Taxonomy, Uid_taxids);
     }
   } else {
     if (Quick_mode)
       call = hits >= Minimum_hit_count ? taxon : 0;
     else
-      call = resolve_tree(hit_counts, Parent_map);
+      call = Taxonomy.resolve_tree(hit_counts);
   }
 
   ++(my_taxon_counts[call].n_reads);
 
-  if (Print_unclassified && !call) 
-    print_sequence(&uoss, dna);
+  if (Print_unclassified && !call)
+    print_sequence(ubuf, dna);
 
   if (Print_classified && call)
-    print_sequence(&coss, dna);
+    print_sequence(cbuf, dna);
 
 
   if (! Print_kraken)
     return call;
 
-  if (call) {
-    koss << "C\t";
-  }
-  else {
-    if (Only_classified_kraken_output)
-      return false;
-    koss << "U\t";
+  if (!call && Only_classified_kraken_output)
+    return false;
+
+  if (Binary_kraken_output) {
+    append_binary_record(kbuf, call, dna.seq.size(), hits, taxa, ambig_list);
+    ibuf += dna.id;
+    ibuf += '\n';
+    return call;
   }
-  koss << dna.id << '\t' << call << '\t' << dna.seq.size() << '\t';
+
+  kbuf += call ? "C\t" : "U\t";
+  kbuf += dna.id;
+  kbuf += '\t';
+  append_uint(kbuf, call);
+  kbuf += '\t';
+  append_uint(kbuf, dna.seq.size());
+  kbuf += '\t';
 
   if (Quick_mode) {
-    koss << "Q:" << hits;
+    kbuf += "Q:";
+    append_uint(kbuf, hits);
   }
   else {
     if (taxa.empty())
-      koss << "0:0";
+      kbuf += "0:0";
     else
-      koss << hitlist_string(taxa, ambig_list);
-    //if (hitlist_string.empty() && last_counter == 0)
-    //  koss << "0:0";
-    //else {
-    //  koss << hitlist_string
-    //       << (last_taxon == ambig_taxon? "A" :  std::to_string(last_taxon))
-    //       << ':' << std::to_string(last_counter);
-    //}
+      append_hitlist_string(kbuf, taxa, ambig_list);
   }
 
-  if (Print_sequence)
-      koss << "\t" << dna.seq;
+  if (Print_sequence) {
+    kbuf += '\t';
+    kbuf += dna.seq;
+  }
 
-  koss << "\n";
+  kbuf += '\n';
   return call;
 }
 
@@ -644,7 +824,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "d:i:t:u:n:m:o:qfcC:U:Ma:r:sI:p:")) != -1) {
+  while ((opt = getopt(argc, argv, "d:i:t:u:n:m:o:bHxzqfcC:U:Ma:r:R:sI:p:P")) != -1) {
     switch (opt) {
       case 'd' :
         DB_filenames.push_back(optarg);
@@ -666,6 +846,9 @@ void parse_command_line(int argc, char **argv) {
       case 'p' :
         HLL_PRECISION = stoi(optarg);
         break;
+      case 'P' :
+        hll_use_packed_registers(true);
+        break;
       case 'q' :
         Quick_mode = true;
         break;
@@ -695,6 +878,21 @@ void parse_command_line(int argc, char **argv) {
       case 'r' :
         Report_output_file = optarg;
         break;
+      case 'R' :
+        Read_counts_file = optarg;
+        break;
+      case 'b' :
+        Binary_kraken_output = true;
+        break;
+      case 'x' :
+        Exact_kmer_counts = true;
+        break;
+      case 'z' :
+        Count_unmatched_kmers = false;
+        break;
+      case 'H' :
+        Binary_output_hitlists = false;
+        break;
       case 's' :
         Print_sequence = true;
         break;
@@ -740,10 +938,19 @@ void usage(int exit_code) {
        << "* -d filename      Kraken DB filename" << endl
        << "* -i filename      Kraken DB index filename" << endl
        << "  -o filename      Output file for Kraken output" << endl
+       << "  -b               Write Kraken output in binary format (read IDs go to <output>.ids)" << endl
+       << "  -H               Do not include k-mer hit lists in binary Kraken output" << endl
+       << "  -x               Count unique k-mers exactly, using a bitmap over the database" << endl
+       << "                   positions (key count / 8 bytes per database) instead of HLL" << endl
+       << "  -z               Do not count k-mers that are not in the database (taxon 0)" << endl
        << "  -r filename      Output file for Kraken report output" << endl
+       << "  -R filename      Output file for taxon counts and k-mer sketches, which can" << endl
+       << "                   be merged with those of other runs with merge_reports" << endl
        << "  -a filename      TaxDB" << endl
        << "  -I filename      UID to TaxId map" << endl
        << "  -p #             Precision for unique k-mer counting, between 10 and 18" << endl
+       << "  -P               Pack the HLL registers into 6 bits (25% less memory for" << endl
+       << "                   k-mer counting, slightly slower)" << endl
        << "  -t #             Number of threads" << endl
        << "  -u #             Thread work unit size (in bp)" << endl
        << "  -q               Quick operation" << endl
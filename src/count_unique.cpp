@@ -22,6 +22,7 @@
 #include <fstream>
 #include <random>
 #include <limits>
+#include <chrono>
 
  #include <ctype.h>
 #include <stdio.h>
@@ -40,10 +41,19 @@ int usage(int exit_code) {
 "OPTIONS:\n"
 "  -p PRECISION   Precision in range of 10 to 18 (required)\n"
 "  -r INT         Create INT random numbers, instead of counting from STDIN\n"
+"  -b             Read binary 64-bit numbers (native byte order) from STDIN,\n"
+"                 e.g. the output of dump_db_kmers -b\n"
+"  -T INT         Number of threads for -b and -r (default: 1). Each thread\n"
+"                 counts into its own sketch, and the sketches are merged\n"
+"                 at the end\n"
 "  -s             Use sparse representation for smaller cardinalities\n"
 "  -t             Test mode - print cardinalities regularily\n"
 "  -y             Show relative error along with cardinality estimates\n"
-"  -e             Use improved cardinality estimator by Otmar Ertl, too\n";
+"  -e             Use improved cardinality estimator by Otmar Ertl, too\n"
+"\n"
+"The relative error is computed against the number of input values, which\n"
+"assumes that they are distinct (as are the k-mers of a database). With -b\n"
+"and -r, the throughput is printed to STDERR.\n";
     return exit_code;
   }
 
@@ -111,6 +121,67 @@ void add_to_hll(HyperLogLogPlusMinus<uint64_t>& hll, uint64_t nr, uint64_t& ctr,
   }
 }
 
+// Number of values read from binary input at once
+const size_t BLOCK_SIZE = 1 << 20;
+
+// Reads binary 64-bit numbers in blocks, and splits each block between the
+// thread sketches. Returns the number of values read.
+uint64_t add_binary_input(FILE* in, vector<HyperLogLogPlusMinus<uint64_t> >& thread_hlls) {
+  vector<uint64_t> block(BLOCK_SIZE);
+  const size_t n_threads = thread_hlls.size();
+  uint64_t ctr = 0;
+  size_t n;
+  while ((n = fread(block.data(), sizeof(uint64_t), BLOCK_SIZE, in)) > 0) {
+    const size_t chunk = (n + n_threads - 1) / n_threads;
+    #pragma omp parallel for num_threads(n_threads) schedule(static, 1)
+    for (size_t t = 0; t < n_threads; ++t) {
+      size_t start = t * chunk;
+      if (start < n)
+        thread_hlls[t].add(block.data() + start, min(chunk, n - start));
+    }
+    ctr += n;
+  }
+  if (ferror(in)) {
+    cerr << "Error reading binary input" << endl;
+    exit(1);
+  }
+  return ctr;
+}
+
+// Adds n_rand random numbers, split between the thread sketches
+void add_random_numbers(vector<HyperLogLogPlusMinus<uint64_t> >& thread_hlls, size_t n_rand, std::random_device& rd) {
+  const size_t n_threads = thread_hlls.size();
+  vector<std::random_device::result_type> seeds(n_threads);
+  for (auto& seed : seeds)
+    seed = rd();
+  #pragma omp parallel for num_threads(n_threads) schedule(static, 1)
+  for (size_t t = 0; t < n_threads; ++t) {
+    std::mt19937_64 rng(seeds[t]);
+    std::uniform_int_distribution<uint64_t> distr;
+    vector<uint64_t> block(std::min(n_rand, BLOCK_SIZE));
+    for (size_t i = t * BLOCK_SIZE; i < n_rand; i += n_threads * BLOCK_SIZE) {
+      size_t n = std::min(BLOCK_SIZE, n_rand - i);
+      for (size_t j = 0; j < n; ++j)
+        block[j] = distr(rng);
+      thread_hlls[t].add(block.data(), n);
+    }
+  }
+}
+
+// Merges the thread sketches into hll
+void merge_thread_hlls(HyperLogLogPlusMinus<uint64_t>& hll, vector<HyperLogLogPlusMinus<uint64_t> >& thread_hlls) {
+  for (auto& thread_hll : thread_hlls) {
+    hll += thread_hll;
+    thread_hll.reset();
+  }
+}
+
+void print_throughput(uint64_t ctr, chrono::steady_clock::time_point start) {
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  cerr << "Counted " << ctr << " numbers in " << secs << " s ("
+       << (secs > 0 ? ctr / secs / 1e6 : 0) << " M numbers/s)" << endl;
+}
+
 
 int main(int argc, char **argv) {
 
@@ -122,12 +193,14 @@ int main(int argc, char **argv) {
   bool flajolet_too = false;
   bool show_rel_error = false;
   bool use_stdin = true;
+  bool binary_input = false;
+  size_t n_threads = 1;
   size_t n_rand = 1;
   size_t n_redo = 1;
 
   int c;
 
-  while ((c = getopt (argc, argv, "shtep:r:yx:f")) != -1)
+  while ((c = getopt (argc, argv, "shtep:r:yx:fbT:")) != -1)
     switch (c) {
       case 's': sparse = true; break;
       case 't': test_mode = true; break;
@@ -139,9 +212,11 @@ int main(int argc, char **argv) {
                 n_rand = stoll(optarg); 
                 break;
       case 'x': n_redo = stoi(optarg); break;
+      case 'b': binary_input = true; break;
+      case 'T': n_threads = stoi(optarg); break;
       case 'h': return usage(0); break;
       case '?':
-        if (optopt == 'p' || optopt == 'r')
+        if (optopt == 'p' || optopt == 'r' || optopt == 'x' || optopt == 'T')
           fprintf (stderr, "Option -%c requires an argument.\n", optopt);
         else if (isprint (optopt))
           fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -154,6 +229,11 @@ int main(int argc, char **argv) {
         abort ();
       }
 
+  if (n_threads == 0 || (test_mode && n_threads > 1)) {
+    fprintf(stderr, "Test mode requires a single thread, and -T at least one.\n");
+    return 1;
+  }
+
   HyperLogLogPlusMinus<uint64_t> hll(p, sparse); // unique k-mer count per taxon
   //HyperLogLogPlusMinus<uint64_t> hll(p, sparse, wang_mixer); // unique k-mer count per taxon
 
@@ -179,13 +259,38 @@ int main(int argc, char **argv) {
   } 
   uint64_t ctr = 0;
   
-  if (use_stdin) {
+  if (use_stdin && !binary_input) {
     uint64_t nr;
     while (cin >> nr) {
       add_to_hll(hll, nr, ctr, test_mode, show_rel_error, heule_too, flajolet_too, ertl_too);
     }
     if (!test_mode) 
       print_card(hll, ctr, show_rel_error, heule_too, flajolet_too, ertl_too);
+  } else if (use_stdin) {
+    if (test_mode) {
+      uint64_t nr;
+      while (fread(&nr, sizeof(nr), 1, stdin) == 1) {
+        add_to_hll(hll, nr, ctr, test_mode, show_rel_error, heule_too, flajolet_too, ertl_too);
+      }
+    } else {
+      vector<HyperLogLogPlusMinus<uint64_t> > thread_hlls(n_threads, HyperLogLogPlusMinus<uint64_t>(p, sparse));
+      auto start = chrono::steady_clock::now();
+      ctr = add_binary_input(stdin, thread_hlls);
+      merge_thread_hlls(hll, thread_hlls);
+      print_throughput(ctr, start);
+      print_card(hll, ctr, show_rel_error, heule_too, flajolet_too, ertl_too);
+    }
+  } else if (!test_mode) {
+    std::random_device rd;
+    vector<HyperLogLogPlusMinus<uint64_t> > thread_hlls(n_threads, HyperLogLogPlusMinus<uint64_t>(p, sparse));
+    for (size_t j = 0; j < n_redo; ++j) {
+      auto start = chrono::steady_clock::now();
+      add_random_numbers(thread_hlls, n_rand, rd);
+      merge_thread_hlls(hll, thread_hlls);
+      print_throughput(n_rand, start);
+      print_card(hll, n_rand, show_rel_error, heule_too, flajolet_too, ertl_too);
+      hll.reset();
+    }
   } else {
     // get random seed from random_device RNG
     std::random_device rd;
@@ -199,12 +304,9 @@ int main(int argc, char **argv) {
       for(size_t i = 0; i < n_rand; i++) {
         add_to_hll(hll, distr(rng), ctr, test_mode, show_rel_error, heule_too, flajolet_too, ertl_too);
       }
-      if (!test_mode) 
-        print_card(hll, ctr, show_rel_error, heule_too, flajolet_too, ertl_too);
       hll.reset();
       ctr = 0;
     }
   }
   
 }
-
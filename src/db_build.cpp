@@ -0,0 +1,362 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Builds a sorted database with zero values and its index directly from
+// FASTA files, in place of counting k-mers with Jellyfish and db_sort.
+// The canonical k-mers are collected in buckets of consecutive bins, which
+// are compacted (sorted and deduplicated) whenever their memory has doubled,
+// and written to disk when they exceed the memory limit. At the end, each
+// bucket is sorted by bin and k-mer and appended to the database.
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include "seqreader.hpp"
+#include <algorithm>
+
+#define SKIP_LEN 50000
+
+using namespace std;
+using namespace kraken;
+
+string Output_DB_filename, Index_filename;
+uint8_t Kmer_len = 31;
+uint8_t Bin_key_nt = 15;
+int Num_threads = 1;
+uint64_t Memory_limit = 0;  // write buckets to disk if the k-mers take more bytes
+
+static const uint64_t BATCH_BASES = 1 << 24;  // bases read before k-mers are collected
+static const uint64_t MIN_COMPACT_BYTES = 1ull << 29;
+static const int MAX_BUCKET_BITS = 10;
+
+KrakenDB Kdb;
+uint64_t N_buckets;
+int Bucket_shift;  // bin key bits below the bucket
+vector< vector<uint64_t> > Buckets;
+vector<bool> Bucket_on_disk;
+uint64_t Kmers_in_memory = 0;
+uint64_t Bytes_in_memory = 0;  // capacity of the buckets
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+static void collect_kmers(vector<DNASequence> &batch,
+                          vector< vector< vector<uint64_t> > > &thread_buckets);
+static void compact_buckets();
+static void write_buckets_to_disk();
+static uint64_t write_database(ofstream &output_file, uint64_t *offsets);
+
+static string bucket_filename(uint64_t b) {
+  return Output_DB_filename + ".bucket" + to_string(b);
+}
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  Kdb = KrakenDB(Kmer_len);
+  KmerScanner::set_k(Kmer_len);
+  int bucket_bits = min(MAX_BUCKET_BITS, 2 * Bin_key_nt);
+  N_buckets = 1ull << bucket_bits;
+  Bucket_shift = 2 * Bin_key_nt - bucket_bits;
+  Buckets.resize(N_buckets);
+  Bucket_on_disk.resize(N_buckets, false);
+
+  vector< vector< vector<uint64_t> > > thread_buckets(Num_threads, vector< vector<uint64_t> >(N_buckets));
+  uint64_t compact_at = MIN_COMPACT_BYTES;
+  uint64_t seqs_processed = 0;
+  for (int i = optind; i < argc; i++) {
+    cerr << "db_build: Collecting k-mers of " << argv[i] << " ..." << endl;
+    FastaReader reader(argv[i]);
+    vector<DNASequence> batch;
+    uint64_t batch_bases = 0;
+    while (reader.is_valid()) {
+      DNASequence dna = reader.next_sequence();
+      bool last = ! reader.is_valid();
+      if (! last && ! dna.seq.empty()) {
+        batch_bases += dna.seq.size();
+        batch.push_back(std::move(dna));
+      }
+      if (batch_bases < BATCH_BASES && ! last)
+        continue;
+
+      collect_kmers(batch, thread_buckets);
+      seqs_processed += batch.size();
+      batch.clear();
+      batch_bases = 0;
+      if (Bytes_in_memory >= compact_at) {
+        compact_buckets();
+        if (Memory_limit > 0 && 2 * Bytes_in_memory > Memory_limit)
+          write_buckets_to_disk();
+        compact_at = max(MIN_COMPACT_BYTES, 2 * Bytes_in_memory);
+        if (Memory_limit > 0)
+          compact_at = min(compact_at, max(MIN_COMPACT_BYTES, Memory_limit));
+      }
+      cerr << "\rProcessed " << seqs_processed << " sequences";
+    }
+    cerr << endl;
+  }
+  thread_buckets.clear();
+
+  cerr << "db_build: Sorting k-mers and writing database ..." << endl;
+  ofstream output_file(Output_DB_filename.c_str(), std::ofstream::binary);
+  if (! output_file)
+    err(EX_CANTCREAT, "unable to create %s", Output_DB_filename.c_str());
+  vector<char> header = Kdb.make_header(0);
+  output_file.write(header.data(), header.size());
+
+  QuickFile idx_file;
+  uint64_t *offsets = KrakenDB::create_index(idx_file, Index_filename, Bin_key_nt);
+  uint64_t key_ct = write_database(output_file, offsets);
+  idx_file.close_file();
+
+  // The number of pairs is known only now
+  header = Kdb.make_header(key_ct);
+  output_file.seekp(0);
+  output_file.write(header.data(), header.size());
+  output_file.close();
+  if (! output_file)
+    err(EX_IOERR, "error writing %s", Output_DB_filename.c_str());
+
+  cerr << "db_build: Wrote " << key_ct << " k-mers." << endl;
+  return 0;
+}
+
+// Adds the canonical k-mers of a batch of sequences to their buckets. The
+// sequences are split into pieces of SKIP_LEN k-mers, and each thread
+// collects the k-mers of its pieces in its own buckets first.
+static void collect_kmers(vector<DNASequence> &batch,
+                          vector< vector< vector<uint64_t> > > &thread_buckets) {
+  vector< pair<size_t, size_t> > pieces;
+  for (size_t s = 0; s < batch.size(); s++)
+    for (size_t i = 0; i < batch[s].seq.size(); i += SKIP_LEN)
+      pieces.push_back(make_pair(s, i));
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t p = 0; p < pieces.size(); p++) {
+    int thread = 0;
+    #ifdef _OPENMP
+    thread = omp_get_thread_num();
+    #endif
+    vector< vector<uint64_t> > &buckets = thread_buckets[thread];
+    size_t start = pieces[p].second;
+    KmerScanner scanner(batch[pieces[p].first].seq, start, start + SKIP_LEN + Kmer_len - 1);
+    uint64_t *kmer_ptr;
+    while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+      if (scanner.ambig_kmer())
+        continue;
+      uint64_t kmer = Kdb.canonical_representation(*kmer_ptr);
+      buckets[Kdb.bin_key(kmer, Bin_key_nt) >> Bucket_shift].push_back(kmer);
+    }
+  }
+
+  Bytes_in_memory = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:Kmers_in_memory,Bytes_in_memory)
+  for (uint64_t b = 0; b < N_buckets; b++) {
+    for (int t = 0; t < Num_threads; t++) {
+      vector<uint64_t> &kmers = thread_buckets[t][b];
+      Buckets[b].insert(Buckets[b].end(), kmers.begin(), kmers.end());
+      Kmers_in_memory += kmers.size();
+      kmers.clear();
+    }
+    Bytes_in_memory += Buckets[b].capacity() * sizeof(uint64_t);
+  }
+}
+
+// Sorts the k-mers in each bucket and removes duplicates. The buckets are
+// shrunk to their size, as they would otherwise keep their largest capacity.
+static void compact_buckets() {
+  Kmers_in_memory = 0;
+  Bytes_in_memory = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:Kmers_in_memory,Bytes_in_memory)
+  for (uint64_t b = 0; b < N_buckets; b++) {
+    vector<uint64_t> &kmers = Buckets[b];
+    sort(kmers.begin(), kmers.end());
+    kmers.erase(unique(kmers.begin(), kmers.end()), kmers.end());
+    kmers.shrink_to_fit();
+    Kmers_in_memory += kmers.size();
+    Bytes_in_memory += kmers.capacity() * sizeof(uint64_t);
+  }
+}
+
+// Appends the compacted buckets to their files, and frees their memory
+static void write_buckets_to_disk() {
+  cerr << endl << "db_build: Writing " << Kmers_in_memory << " k-mers to bucket files ..." << endl;
+  for (uint64_t b = 0; b < N_buckets; b++) {
+    vector<uint64_t> &kmers = Buckets[b];
+    if (kmers.empty())
+      continue;
+    string filename = bucket_filename(b);
+    ofstream bucket_file(filename.c_str(), std::ofstream::binary | std::ofstream::app);
+    bucket_file.write((char *) kmers.data(), kmers.size() * sizeof(uint64_t));
+    bucket_file.close();
+    if (! bucket_file)
+      err(EX_IOERR, "error writing %s", filename.c_str());
+    Bucket_on_disk[b] = true;
+    vector<uint64_t>().swap(kmers);
+  }
+  Kmers_in_memory = 0;
+  Bytes_in_memory = 0;
+}
+
+// Sorts each bucket by bin and k-mer, removes duplicate k-mers, and appends
+// the pairs to the database. The bin offsets are set in the index, and the
+// number of pairs is returned.
+static uint64_t write_database(ofstream &output_file, uint64_t *offsets) {
+  uint64_t key_len = Kdb.get_key_len();
+  uint64_t val_len = Kdb.get_val_len();
+  uint64_t pair_size = key_len + val_len;
+  uint64_t bucket_bins = 1ull << Bucket_shift;
+  uint64_t key_ct = 0;
+
+  vector<uint64_t> kmers, sorted_kmers, b_keys;
+  vector<uint64_t> pos(bucket_bins + 1);
+  vector<char> pairs;
+  for (uint64_t b = 0; b < N_buckets; b++) {
+    kmers.swap(Buckets[b]);
+    vector<uint64_t>().swap(Buckets[b]);
+    if (Bucket_on_disk[b]) {
+      string filename = bucket_filename(b);
+      ifstream bucket_file(filename.c_str(), std::ifstream::binary | std::ifstream::ate);
+      if (! bucket_file)
+        err(EX_NOINPUT, "unable to open %s", filename.c_str());
+      uint64_t n_disk = bucket_file.tellg() / sizeof(uint64_t);
+      uint64_t n_mem = kmers.size();
+      kmers.resize(n_mem + n_disk);
+      bucket_file.seekg(0);
+      bucket_file.read((char *) (kmers.data() + n_mem), n_disk * sizeof(uint64_t));
+      if (! bucket_file)
+        err(EX_IOERR, "error reading %s", filename.c_str());
+      bucket_file.close();
+      remove(filename.c_str());
+    }
+    uint64_t n = kmers.size();
+    uint64_t first_bin = b * bucket_bins;
+
+    // Put the k-mers into the order of their bins
+    b_keys.resize(n);
+    #pragma omp parallel for
+    for (uint64_t i = 0; i < n; i++)
+      b_keys[i] = Kdb.bin_key(kmers[i], Bin_key_nt) - first_bin;
+    fill(pos.begin(), pos.end(), 0);
+    for (uint64_t i = 0; i < n; i++)
+      pos[b_keys[i] + 1]++;
+    for (uint64_t i = 1; i <= bucket_bins; i++)
+      pos[i] += pos[i-1];
+    sorted_kmers.resize(n);
+    {
+      vector<uint64_t> next(pos.begin(), pos.end() - 1);
+      for (uint64_t i = 0; i < n; i++)
+        sorted_kmers[next[b_keys[i]]++] = kmers[i];
+    }
+    vector<uint64_t>().swap(kmers);
+
+    // Sort the bins and set the offsets of their unique k-mers
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (uint64_t i = 0; i < bucket_bins; i++) {
+      uint64_t *bin_start = sorted_kmers.data() + pos[i];
+      uint64_t *bin_end = sorted_kmers.data() + pos[i+1];
+      sort(bin_start, bin_end);
+      offsets[first_bin + i + 1] = unique(bin_start, bin_end) - bin_start;
+    }
+    offsets[first_bin] = key_ct;
+    for (uint64_t i = first_bin + 1; i <= first_bin + bucket_bins; i++)
+      offsets[i] += offsets[i-1];
+    uint64_t bucket_ct = offsets[first_bin + bucket_bins] - key_ct;
+
+    pairs.assign(bucket_ct * pair_size, 0);
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (uint64_t i = 0; i < bucket_bins; i++) {
+      char *pair = pairs.data() + (offsets[first_bin + i] - key_ct) * pair_size;
+      for (uint64_t j = 0; j < offsets[first_bin + i + 1] - offsets[first_bin + i]; j++) {
+        memcpy(pair, &sorted_kmers[pos[i] + j], key_len);
+        pair += pair_size;
+      }
+    }
+    output_file.write(pairs.data(), pairs.size());
+    key_ct += bucket_ct;
+  }
+  return key_ct;
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "k:n:o:i:t:m:")) != -1) {
+    switch (opt) {
+      case 'k' :
+        sig = atoll(optarg);
+        if (sig < 2 || sig > 31)
+          errx(EX_USAGE, "k-mer length out of range");
+        Kmer_len = (uint8_t) sig;
+        break;
+      case 'n' :
+        sig = atoll(optarg);
+        if (sig < 1 || sig > 31)
+          errx(EX_USAGE, "bin key length out of range");
+        Bin_key_nt = (uint8_t) sig;
+        break;
+      case 'o' :
+        Output_DB_filename = optarg;
+        break;
+      case 'i' :
+        Index_filename = optarg;
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        Num_threads = sig;
+        omp_set_num_threads(Num_threads);
+        #endif
+        break;
+      case 'm' :
+        if (atof(optarg) <= 0)
+          errx(EX_USAGE, "memory limit must be positive");
+        Memory_limit = atof(optarg) * (1ull << 30);
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Bin_key_nt >= Kmer_len)
+    errx(EX_USAGE, "bin key length must be less than k");
+  if (Output_DB_filename.empty() || Index_filename.empty() || optind == argc)
+    usage();
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: db_build [-t threads] [-k k] [-n nt] [-m GB] <-o output db> <-i output idx> <FASTA file(s)>\n"
+       << "  -k k   k-mer length (default: 31)\n"
+       << "  -n nt  bin key length (default: 15)\n"
+       << "  -m GB  write the k-mers to disk when they take more than about GB\n"
+       << "         gigabytes of memory (the index is not counted)\n";
+  exit(exit_code);
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Merges sorted databases with the same k and bin key length into one. The
+// bins are merged independently, in two passes over the memory-mapped
+// databases: the first counts the distinct k-mers of each bin for the
+// index, and the second writes them to their offsets in the output.
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include "taxdb.hpp"
+
+using namespace std;
+using namespace kraken;
+
+static const size_t MAX_DATABASES = 256;
+
+string Output_DB_filename, Output_index_filename, TaxDB_filename, Kmer_count_filename;
+bool Use_priority = false;
+int Num_threads = 1;
+
+vector<QuickFile *> DB_files, Index_files;
+vector<KrakenDB *> Databases;
+vector<KrakenDBIndex *> Indices;
+uint64_t Key_len, Pair_size;
+unordered_map<uint32_t, uint32_t> Parent_map;
+TaxonomyTree Taxonomy;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+static uint64_t merge_bin(uint64_t bin, char *out);
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  if (! TaxDB_filename.empty()) {
+    TaxonomyDB<uint32_t> taxdb(TaxDB_filename);
+    Parent_map = taxdb.getParentMap();
+    Taxonomy = TaxonomyTree(Parent_map);
+  }
+
+  uint64_t key_ct = 0;
+  for (int i = optind; i < argc; i += 2) {
+    DB_files.push_back(new QuickFile(argv[i]));
+    Index_files.push_back(new QuickFile(argv[i+1]));
+    Databases.push_back(new KrakenDB(DB_files.back()->ptr()));
+    Indices.push_back(new KrakenDBIndex(Index_files.back()->ptr()));
+    Databases.back()->set_index(Indices.back());
+    if (Databases.back()->get_key_bits() != Databases[0]->get_key_bits())
+      errx(EX_DATAERR, "%s: k differs from %s", argv[i], argv[optind]);
+    if (Indices.back()->indexed_nt() != Indices[0]->indexed_nt())
+      errx(EX_DATAERR, "%s: bin key length differs from %s", argv[i+1], argv[optind+1]);
+    key_ct += Databases.back()->get_key_ct();
+  }
+  Key_len = Databases[0]->get_key_len();
+  Pair_size = Databases[0]->pair_size();
+  uint8_t nt = Indices[0]->indexed_nt();
+  uint64_t entries = 1ull << (nt * 2);
+
+  cerr << "db_merge: Counting the k-mers of " << Databases.size() << " databases ..." << endl;
+  QuickFile output_idx_file;
+  uint64_t *offsets = KrakenDB::create_index(output_idx_file, Output_index_filename, nt);
+  offsets[0] = 0;
+  #pragma omp parallel for schedule(dynamic, 65536)
+  for (uint64_t bin = 0; bin < entries; bin++)
+    offsets[bin + 1] = merge_bin(bin, NULL);
+  for (uint64_t bin = 1; bin <= entries; bin++)
+    offsets[bin] += offsets[bin - 1];
+  uint64_t merged_key_ct = offsets[entries];
+  cerr << "db_merge: Merging " << key_ct << " k-mers into " << merged_key_ct << " distinct k-mers ..." << endl;
+
+  vector<char> header = Databases[0]->make_header(merged_key_ct);
+  QuickFile output_file(Output_DB_filename, "w", header.size() + merged_key_ct * Pair_size);
+  memcpy(output_file.ptr(), header.data(), header.size());
+  char *output_pairs = output_file.ptr() + header.size();
+  #pragma omp parallel for schedule(dynamic, 65536)
+  for (uint64_t bin = 0; bin < entries; bin++)
+    merge_bin(bin, output_pairs + offsets[bin] * Pair_size);
+
+  if (! Kmer_count_filename.empty()) {
+    KrakenDB output_db(output_file.ptr());
+    ofstream ofs(Kmer_count_filename.c_str());
+    cerr << "Writing kmer counts to " << Kmer_count_filename << "..." << endl;
+    auto counts = output_db.count_taxons();
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+      ofs << it->first << '\t' << it->second << '\n';
+    }
+    ofs.close();
+  }
+  output_file.close_file();
+  output_idx_file.close_file();
+
+  for (size_t d = 0; d < Databases.size(); d++) {
+    delete Databases[d];
+    delete Indices[d];
+    delete DB_files[d];
+    delete Index_files[d];
+  }
+  return 0;
+}
+
+static inline uint64_t pair_key(const char *pair) {
+  uint64_t key = 0;
+  memcpy(&key, pair, Key_len);
+  return key;
+}
+
+// The LCA is only meaningful for values that are taxids of the taxonomy;
+// the LCA of unknown values would be the root. The values of a UID database
+// (set_lcas -I) are not in the taxonomy, or only by chance.
+static inline void check_taxid(uint32_t val) {
+  if (val != 0 && Parent_map.find(val) == Parent_map.end())
+    errx(EX_DATAERR, "database value %u is not a taxid of the taxonomy; UID databases are not supported", val);
+}
+
+// Merges the pairs of a bin in all databases into out, or only counts them
+// if out is NULL. A k-mer in several databases gets the LCA of its values,
+// or the value of the first database with -p. Returns the number of pairs.
+static uint64_t merge_bin(uint64_t bin, char *out) {
+  size_t n_dbs = Databases.size();
+  const char *pos[MAX_DATABASES], *end[MAX_DATABASES];
+  size_t n_nonempty = 0, nonempty_db = 0;
+  for (size_t d = 0; d < n_dbs; d++) {
+    uint64_t *offsets = Indices[d]->get_array();
+    pos[d] = Databases[d]->get_pair_ptr() + offsets[bin] * Pair_size;
+    end[d] = Databases[d]->get_pair_ptr() + offsets[bin + 1] * Pair_size;
+    if (pos[d] < end[d]) {
+      n_nonempty++;
+      nonempty_db = d;
+    }
+  }
+
+  // Bins in only one database are copied as they are
+  if (n_nonempty <= 1) {
+    uint64_t size = n_nonempty ? end[nonempty_db] - pos[nonempty_db] : 0;
+    if (out != NULL)
+      memcpy(out, pos[nonempty_db], size);
+    return size / Pair_size;
+  }
+
+  uint64_t n = 0;
+  while (true) {
+    bool found = false;
+    uint64_t min_kmer = 0;
+    for (size_t d = 0; d < n_dbs; d++) {
+      if (pos[d] < end[d] && (! found || pair_key(pos[d]) < min_kmer)) {
+        min_kmer = pair_key(pos[d]);
+        found = true;
+      }
+    }
+    if (! found)
+      break;
+
+    bool have_val = false;
+    uint32_t val = 0;
+    for (size_t d = 0; d < n_dbs; d++) {
+      if (pos[d] == end[d] || pair_key(pos[d]) != min_kmer)
+        continue;
+      uint32_t db_val;
+      memcpy(&db_val, pos[d] + Key_len, sizeof(db_val));
+      if (! Use_priority)
+        check_taxid(db_val);
+      if (! have_val)
+        val = db_val;
+      else if (! Use_priority)
+        val = Taxonomy.lca(val, db_val);
+      have_val = true;
+      pos[d] += Pair_size;
+    }
+    if (out != NULL) {
+      memcpy(out, &min_kmer, Key_len);
+      memcpy(out + Key_len, &val, sizeof(val));
+      out += Pair_size;
+    }
+    n++;
+  }
+  return n;
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "o:O:b:c:pt:h")) != -1) {
+    switch (opt) {
+      case 'o' :
+        Output_DB_filename = optarg;
+        break;
+      case 'O' :
+        Output_index_filename = optarg;
+        break;
+      case 'b' :
+        TaxDB_filename = optarg;
+        break;
+      case 'c' :
+        Kmer_count_filename = optarg;
+        break;
+      case 'p' :
+        Use_priority = true;
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        Num_threads = sig;
+        omp_set_num_threads(Num_threads);
+        #endif
+        break;
+      case 'h' :
+        usage(0);
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Output_DB_filename.empty() || Output_index_filename.empty())
+    usage();
+  if (TaxDB_filename.empty() && ! Use_priority) {
+    cerr << "Missing mandatory option -b" << endl;
+    usage();
+  }
+  int n_files = argc - optind;
+  if (n_files < 4 || n_files % 2 != 0) {
+    cerr << "Expected at least two pairs of database and index files" << endl;
+    usage();
+  }
+  if ((size_t) n_files / 2 > MAX_DATABASES)
+    errx(EX_USAGE, "can't merge more than %lu databases", (unsigned long) MAX_DATABASES);
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: db_merge [options] <DB 1> <index 1> <DB 2> <index 2> [...]" << endl
+       << endl
+       << "Merges sorted databases with the same k and bin key length. K-mers found in" << endl
+       << "several databases get the LCA of their taxids, which must be in the taxonomy." << endl
+       << "UID databases (set_lcas -I) are only supported with -p." << endl
+       << endl
+       << "Options: (*mandatory)" << endl
+       << "* -o filename      Output DB filename" << endl
+       << "* -O filename      Output DB index filename" << endl
+       << "* -b filename      Taxonomy DB file (not needed with -p)" << endl
+       << "  -p               Give k-mers found in several databases the taxid of the first" << endl
+       << "                   of them on the command line, instead of the LCA" << endl
+       << "  -c filename      Write k-mer counts of the output DB to filename" << endl
+       << "  -t #             Number of threads" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
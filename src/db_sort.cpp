@@ -20,6 +20,7 @@
 #include "kraken_headers.hpp"
 #include "quickfile.hpp"
 #include "krakendb.hpp"
+#include <algorithm>
 
 using namespace std;
 using namespace kraken;
@@ -28,13 +29,15 @@ string Input_DB_filename, Output_DB_filename, Index_filename;
 uint8_t Bin_key_nt = 15;
 int Num_threads = 1;
 bool Zero_vals = false;
+bool Index_only = false;
 bool Operate_in_RAM = false;
+uint64_t Memory_limit = 0;  // sort on disk if the pairs take more bytes
 // Global until I can find a way to pass this to the sorting function
 size_t Key_len = 8;
 
-static int pair_cmp(const void *a, const void *b);
 static void parse_command_line(int argc, char **argv);
 static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx);
+static void sort_on_disk(KrakenDB &kdb);
 static void usage(int exit_code=EX_USAGE);
 
 int main(int argc, char **argv) {
@@ -50,6 +53,18 @@ int main(int argc, char **argv) {
   Key_len = input_db->get_key_len();
   uint64_t val_len = input_db->get_val_len();
   uint64_t key_ct = input_db->get_key_ct();
+  if (Index_only) {
+    cerr << endl << "db_sort: Indexing sorted database ..." << endl;
+    input_db->make_index(Index_filename, Bin_key_nt, true);
+    cerr << "db_sort: Index complete." << endl;
+    return 0;
+  }
+  if (Memory_limit > 0 && key_ct * (Key_len + val_len) > Memory_limit) {
+    cerr << endl << "db_sort: Database exceeds memory limit - sorting on disk ..." << endl;
+    sort_on_disk(*input_db);
+    cerr << "db_sort: Sorting complete." << endl;
+    return 0;
+  }
   input_db->make_index(Index_filename, Bin_key_nt);
   QuickFile index_file(Index_filename);
   KrakenDBIndex db_index(index_file.ptr());
@@ -58,16 +73,14 @@ int main(int argc, char **argv) {
   char *header = new char[ skip_len ];
   memcpy(header, input_db_file.ptr(), skip_len);
 
-  delete input_db;
-  // No longer legit for traversal, but allows access to KDB functions
-  input_db = new KrakenDB(header);
-  input_db_file.close_file();  // Stop using memory-mapped file
-
   cerr << "db_sort: Sorting ...";
   char *data = new char[ key_ct * (Key_len + val_len) ];
   // Populate data w/ pairs from DB and sort bins in parallel
   bin_and_sort_data(*input_db, data, db_index);
 
+  delete input_db;
+  input_db_file.close_file();  // Stop using memory-mapped file
+
   cerr << "db_sort: Sorting complete - writing database to disk ..." << endl;
   ofstream output_file(Output_DB_filename.c_str(), std::ofstream::binary);
   output_file.write(header, skip_len);
@@ -77,6 +90,83 @@ int main(int argc, char **argv) {
   return 0;
 }
 
+static inline uint64_t pair_key(const char *pair) {
+  uint64_t key = 0;
+  memcpy(&key, pair, Key_len);
+  return key;
+}
+
+static void insertion_sort_pairs(char *pairs, uint64_t n, uint64_t pair_size) {
+  char tmp[pair_size];
+  for (uint64_t i = 1; i < n; i++) {
+    uint64_t key = pair_key(pairs + i * pair_size);
+    uint64_t j = i;
+    while (j > 0 && pair_key(pairs + (j - 1) * pair_size) > key)
+      j--;
+    if (j < i) {
+      memcpy(tmp, pairs + i * pair_size, pair_size);
+      memmove(pairs + (j + 1) * pair_size, pairs + j * pair_size, (i - j) * pair_size);
+      memcpy(pairs + j * pair_size, tmp, pair_size);
+    }
+  }
+}
+
+// Sorts pairs by key with an in-place MSD radix sort (American flag sort),
+// starting at the given key byte. Small ranges are insertion sorted.
+static void sort_pairs(char *pairs, uint64_t n, uint64_t pair_size, int byte) {
+  if (n < 64) {
+    insertion_sort_pairs(pairs, n, pair_size);
+    return;
+  }
+
+  uint64_t counts[256] = {0};
+  for (uint64_t i = 0; i < n; i++)
+    counts[(uint8_t) pairs[i * pair_size + byte]]++;
+
+  uint64_t heads[256], tails[256];
+  uint64_t pos = 0;
+  bool single_bucket = false;
+  for (int d = 0; d < 256; d++) {
+    heads[d] = pos;
+    pos += counts[d];
+    tails[d] = pos;
+    single_bucket |= counts[d] == n;
+  }
+
+  if (! single_bucket) {
+    // Swap each pair into the bucket of its key byte
+    char tmp[pair_size];
+    for (int d = 0; d < 256; d++) {
+      while (heads[d] < tails[d]) {
+        char *pair = pairs + heads[d] * pair_size;
+        uint8_t pair_d = pair[byte];
+        if (pair_d == d) {
+          heads[d]++;
+          continue;
+        }
+        char *dest = pairs + heads[pair_d]++ * pair_size;
+        memcpy(tmp, dest, pair_size);
+        memcpy(dest, pair, pair_size);
+        memcpy(pair, tmp, pair_size);
+      }
+    }
+  }
+
+  if (byte == 0)
+    return;
+  for (int d = 0; d < 256; d++) {
+    uint64_t start = tails[d] - counts[d];
+    if (counts[d] > 1)
+      sort_pairs(pairs + start * pair_size, counts[d], pair_size, byte - 1);
+  }
+}
+
+// Bins are grouped into buckets by the high bits of their bin key. Pairs are
+// scattered to these buckets in parallel, each thread taking a contiguous
+// part of the input and writing at its own cursors. Each bucket is then
+// distributed to its bins, and the bins sorted, by a single thread.
+static const int BUCKET_BITS = 16;
+
 static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx) {
   uint8_t nt = idx.indexed_nt();
   uint64_t *offsets = idx.get_array();
@@ -84,45 +174,200 @@ static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx) {
   uint64_t key_len = kdb.get_key_len();
   uint64_t val_len = kdb.get_val_len();
   uint64_t pair_size = key_len + val_len;
-  char pair[pair_size];
-
-  ifstream input_file(Input_DB_filename.c_str(), std::ifstream::binary);
-  input_file.seekg(kdb.header_size(), ios_base::beg);
-
-  // Create a copy of the offsets array for use as insertion positions
-  vector<uint64_t> pos(offsets, offsets + entries);
-  for (uint64_t i = 0; i < kdb.get_key_ct(); i++) {
-    input_file.read(pair, pair_size);
-    uint64_t kmer = 0;
-    memcpy(&kmer, pair, key_len);
-    uint64_t b_key = kdb.bin_key(kmer, nt);
-    char *pair_pos = data + pair_size * pos[b_key]++;
-    // Copy pair into correct bin (but not final position)
-    memcpy(pair_pos, pair, pair_size);
-    if (Zero_vals)
-      memset(pair_pos + key_len, 0, val_len);
-  }
-  input_file.close();
-
-  // Sort all bins
+  uint64_t key_ct = kdb.get_key_ct();
+  char *input = kdb.get_pair_ptr();
+
+  int bucket_shift = nt * 2 > BUCKET_BITS ? nt * 2 - BUCKET_BITS : 0;
+  uint64_t buckets = entries >> bucket_shift;
+
+  // Per-thread bucket histograms, which become the write cursors
+  vector< vector<uint64_t> > cursors(Num_threads, vector<uint64_t>(buckets));
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < Num_threads; t++) {
+    vector<uint64_t> &counts = cursors[t];
+    uint64_t end = key_ct * (t + 1) / Num_threads;
+    for (uint64_t i = key_ct * t / Num_threads; i < end; i++) {
+      uint64_t b_key = kdb.bin_key(pair_key(input + i * pair_size), nt);
+      counts[b_key >> bucket_shift]++;
+    }
+  }
+  for (uint64_t b = 0; b < buckets; b++) {
+    uint64_t pos = offsets[b << bucket_shift];
+    for (int t = 0; t < Num_threads; t++) {
+      uint64_t count = cursors[t][b];
+      cursors[t][b] = pos;
+      pos += count;
+    }
+  }
+
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < Num_threads; t++) {
+    vector<uint64_t> &pos = cursors[t];
+    uint64_t end = key_ct * (t + 1) / Num_threads;
+    for (uint64_t i = key_ct * t / Num_threads; i < end; i++) {
+      const char *pair = input + i * pair_size;
+      uint64_t b_key = kdb.bin_key(pair_key(pair), nt);
+      char *pair_pos = data + pair_size * pos[b_key >> bucket_shift]++;
+      // Copy pair into correct bucket (but not final position)
+      memcpy(pair_pos, pair, pair_size);
+      if (Zero_vals)
+        memset(pair_pos + key_len, 0, val_len);
+    }
+  }
+  cursors.clear();
+
+  // Distribute buckets to bins and sort all bins
   #pragma omp parallel for schedule(dynamic)
-  for (uint64_t i = 0; i < entries; i++) {
-    qsort(data + offsets[i] * pair_size,
-          offsets[i+1] - offsets[i], pair_size,
-          pair_cmp);
+  for (uint64_t b = 0; b < buckets; b++) {
+    uint64_t first_bin = b << bucket_shift;
+    uint64_t last_bin = first_bin + (1ull << bucket_shift);
+    uint64_t bucket_start = offsets[first_bin];
+    uint64_t bucket_size = offsets[last_bin] - bucket_start;
+    if (bucket_size == 0)
+      continue;
+    char *bucket = data + bucket_start * pair_size;
+    if (bucket_shift > 0) {
+      vector<char> tmp(bucket, bucket + bucket_size * pair_size);
+      vector<uint64_t> pos(offsets + first_bin, offsets + last_bin);
+      for (uint64_t i = 0; i < bucket_size; i++) {
+        const char *pair = tmp.data() + i * pair_size;
+        uint64_t b_key = kdb.bin_key(pair_key(pair), nt);
+        memcpy(data + pair_size * pos[b_key - first_bin]++, pair, pair_size);
+      }
+    }
+    for (uint64_t i = first_bin; i < last_bin; i++) {
+      sort_pairs(data + offsets[i] * pair_size,
+                 offsets[i+1] - offsets[i], pair_size, key_len - 1);
+    }
   }
 }
 
-static int pair_cmp(const void *a, const void *b) {
-  uint64_t aval = 0, bval = 0;
-  memcpy(&aval, a, Key_len);
-  memcpy(&bval, b, Key_len);
-  if (aval < bval)
-    return -1;
-  else if (aval == bval)
-    return 0;
-  else
-    return 1;
+// Pairs are read in blocks, and the bin keys of a block computed in parallel
+static const uint64_t READ_BLOCK_PAIRS = 1 << 20;
+static const uint64_t MAX_BUCKET_FILES = 512;
+
+static void compute_bin_keys(KrakenDB &kdb, const char *block, uint64_t n,
+                             uint64_t pair_size, vector<uint64_t> &b_keys)
+{
+  #pragma omp parallel for schedule(static)
+  for (uint64_t i = 0; i < n; i++)
+    b_keys[i] = kdb.bin_key(pair_key(block + i * pair_size), Bin_key_nt);
+}
+
+// External memory sort: one pass over the input writes the pairs to bucket
+// files by bin key range, and counts the bins for the index. Each bucket is
+// then read back in chunks of bins that fit into the memory limit; the
+// pairs of a chunk are placed into their bins, the bins sorted in parallel
+// and the chunk appended to the output database.
+static void sort_on_disk(KrakenDB &kdb) {
+  uint8_t nt = Bin_key_nt;
+  uint64_t entries = 1ull << (nt * 2);
+  uint64_t key_len = kdb.get_key_len();
+  uint64_t val_len = kdb.get_val_len();
+  uint64_t pair_size = key_len + val_len;
+  uint64_t key_ct = kdb.get_key_ct();
+  char *input = kdb.get_pair_ptr();
+
+  uint64_t block_size = READ_BLOCK_PAIRS * (pair_size + sizeof(uint64_t));
+  uint64_t chunk_pairs = Memory_limit > 2 * block_size
+                           ? (Memory_limit - block_size) / pair_size
+                           : block_size / pair_size;
+  // Buckets of half a chunk leave room for uneven bin sizes
+  uint64_t n_buckets = min(MAX_BUCKET_FILES, max((uint64_t) 2, 2 * key_ct / chunk_pairs + 1));
+  n_buckets = min(n_buckets, entries);
+  uint64_t bucket_bins = (entries + n_buckets - 1) / n_buckets;
+  n_buckets = (entries + bucket_bins - 1) / bucket_bins;
+
+  QuickFile idx_file;
+  uint64_t *offsets = KrakenDB::create_index(idx_file, Index_filename, nt);
+
+  vector<string> bucket_filenames(n_buckets);
+  vector<ofstream> bucket_files(n_buckets);
+  for (uint64_t b = 0; b < n_buckets; b++) {
+    bucket_filenames[b] = Output_DB_filename + ".bucket" + to_string(b);
+    bucket_files[b].open(bucket_filenames[b].c_str(), std::ofstream::binary);
+    if (! bucket_files[b])
+      err(EX_CANTCREAT, "unable to create %s", bucket_filenames[b].c_str());
+  }
+
+  cerr << "db_sort: Writing " << n_buckets << " bucket files ..." << endl;
+  vector<uint64_t> b_keys(READ_BLOCK_PAIRS);
+  for (uint64_t start = 0; start < key_ct; start += READ_BLOCK_PAIRS) {
+    uint64_t n = min(READ_BLOCK_PAIRS, key_ct - start);
+    const char *block = input + start * pair_size;
+    compute_bin_keys(kdb, block, n, pair_size, b_keys);
+    for (uint64_t i = 0; i < n; i++) {
+      offsets[b_keys[i] + 1]++;
+      bucket_files[b_keys[i] / bucket_bins].write(block + i * pair_size, pair_size);
+    }
+  }
+  for (uint64_t b = 0; b < n_buckets; b++) {
+    bucket_files[b].close();
+    if (! bucket_files[b])
+      err(EX_IOERR, "error writing %s", bucket_filenames[b].c_str());
+  }
+  bucket_files.clear();
+
+  // Turn bin counts into offsets
+  for (uint64_t i = 1; i <= entries; i++)
+    offsets[i] += offsets[i-1];
+
+  ofstream output_file(Output_DB_filename.c_str(), std::ofstream::binary);
+  if (! output_file)
+    err(EX_CANTCREAT, "unable to create %s", Output_DB_filename.c_str());
+  output_file.write(kdb.get_ptr(), kdb.header_size());
+
+  vector<char> data;
+  vector<char> block(READ_BLOCK_PAIRS * pair_size);
+  for (uint64_t b = 0; b < n_buckets; b++) {
+    uint64_t last_bin = min(entries, (b + 1) * bucket_bins);
+    uint64_t chunk_first = b * bucket_bins;
+    while (chunk_first < last_bin) {
+      // Take as many bins as fit, but at least one
+      uint64_t *chunk_end = upper_bound(offsets + chunk_first + 1, offsets + last_bin + 1,
+                                        offsets[chunk_first] + chunk_pairs);
+      uint64_t chunk_last = max(chunk_first + 1, (uint64_t) (chunk_end - offsets) - 1);
+      uint64_t chunk_start = offsets[chunk_first];
+      uint64_t chunk_size = offsets[chunk_last] - chunk_start;
+      if (chunk_size == 0) {
+        chunk_first = chunk_last;
+        continue;
+      }
+
+      data.resize(chunk_size * pair_size);
+      vector<uint64_t> pos(offsets + chunk_first, offsets + chunk_last);
+      ifstream bucket_file(bucket_filenames[b].c_str(), std::ifstream::binary);
+      if (! bucket_file)
+        err(EX_NOINPUT, "unable to open %s", bucket_filenames[b].c_str());
+      while (bucket_file) {
+        bucket_file.read(block.data(), block.size());
+        uint64_t n = bucket_file.gcount() / pair_size;
+        compute_bin_keys(kdb, block.data(), n, pair_size, b_keys);
+        for (uint64_t i = 0; i < n; i++) {
+          if (b_keys[i] < chunk_first || b_keys[i] >= chunk_last)
+            continue;
+          char *pair_pos = data.data() + pair_size * (pos[b_keys[i] - chunk_first]++ - chunk_start);
+          memcpy(pair_pos, block.data() + i * pair_size, pair_size);
+          if (Zero_vals)
+            memset(pair_pos + key_len, 0, val_len);
+        }
+      }
+      if (bucket_file.bad())
+        err(EX_IOERR, "error reading %s", bucket_filenames[b].c_str());
+
+      #pragma omp parallel for schedule(dynamic)
+      for (uint64_t i = chunk_first; i < chunk_last; i++) {
+        sort_pairs(data.data() + (offsets[i] - chunk_start) * pair_size,
+                   offsets[i+1] - offsets[i], pair_size, key_len - 1);
+      }
+      output_file.write(data.data(), chunk_size * pair_size);
+      chunk_first = chunk_last;
+    }
+    remove(bucket_filenames[b].c_str());
+  }
+  output_file.close();
+  if (! output_file)
+    err(EX_IOERR, "error writing %s", Output_DB_filename.c_str());
 }
 
 void parse_command_line(int argc, char **argv) {
@@ -131,7 +376,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "n:d:o:i:t:zM")) != -1) {
+  while ((opt = getopt(argc, argv, "n:d:o:i:t:m:szM")) != -1) {
     switch (opt) {
       case 'n' :
         sig = atoll(optarg);
@@ -162,6 +407,14 @@ void parse_command_line(int argc, char **argv) {
         omp_set_num_threads(Num_threads);
         #endif
         break;
+      case 'm' :
+        if (atof(optarg) <= 0)
+          errx(EX_USAGE, "memory limit must be positive");
+        Memory_limit = atof(optarg) * (1ull << 30);
+        break;
+      case 's' :
+        Index_only = true;
+        break;
       case 'z' :
         Zero_vals = true;
         break;
@@ -171,12 +424,16 @@ void parse_command_line(int argc, char **argv) {
     }
   }
 
-  if (Input_DB_filename.empty() || Output_DB_filename.empty()
-      || Index_filename.empty())
+  if (Input_DB_filename.empty() || Index_filename.empty()
+      || (Output_DB_filename.empty() && ! Index_only))
     usage();
 }
 
 void usage(int exit_code) {
-  cerr << "Usage: db_sort [-z] [-M] [-t threads] [-n nt] <-d input db> <-o output db> <-i output idx>\n";
+  cerr << "Usage: db_sort [-z] [-M] [-t threads] [-n nt] [-m GB] <-d input db> <-o output db> <-i output idx>\n"
+       << "       db_sort -s [-t threads] [-n nt] <-d sorted db> <-i output idx>\n"
+       << "  -s     only write the index of a database that is already sorted\n"
+       << "  -m GB  sort on disk if the database is larger than GB gigabytes, keeping\n"
+       << "         this much of it in memory (the index is not counted)\n";
   exit(exit_code);
 }
@@ -0,0 +1,409 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Adds the k-mers of new sequences to a sorted LCA database, without
+// rebuilding it from the whole library. The k-mers of the new sequences are
+// sorted by bin and k-mer with the LCA of their taxids, and merged with the
+// database bins in one pass: k-mers that are in the database get the LCA of
+// both values, and the others are inserted into their bins.
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include "seqreader.hpp"
+#include "taxdb.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+#define SKIP_LEN 50000
+
+// The new k-mers are sorted and merged whenever they have doubled
+static const size_t MIN_MERGE_KMERS = 1 << 26;
+
+using namespace std;
+using namespace kraken;
+
+string DB_filename, Index_filename, Output_DB_filename, Output_index_filename,
+  TaxDB_filename, ID_to_taxon_map_filename, Kmer_count_filename;
+int Num_threads = 1;
+bool verbose = false;
+
+const string prefix = "kraken:taxid|";
+
+struct KmerTaxid {
+  uint64_t kmer;
+  uint32_t bin_key;
+  uint32_t taxid;
+};
+
+// A bin with new k-mers, and the number of them that are not in the database
+struct NewBin {
+  uint32_t bin_key;
+  uint64_t start, end;  // range of the bin in the new k-mers
+  uint64_t added;
+};
+
+KrakenDB Database;
+TaxonomyTree Taxonomy;
+unordered_map<uint32_t, uint32_t> Parent_map;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+static unordered_map<string, uint32_t> read_seqid_to_taxid_map(string filename);
+static void add_kmers(vector<KmerTaxid> &kmers, uint32_t taxid, string &seq);
+static void sort_and_merge_new_kmers(vector<KmerTaxid> &kmers);
+static void merge_into_database(const vector<KmerTaxid> &kmers, uint8_t nt,
+                                uint64_t *offsets, char *output_pairs);
+
+static int max_threads() {
+  #ifdef _OPENMP
+  return omp_get_max_threads();
+  #else
+  return 1;
+  #endif
+}
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  TaxonomyDB<uint32_t> taxdb(TaxDB_filename);
+  Parent_map = taxdb.getParentMap();
+  Taxonomy = TaxonomyTree(Parent_map);
+  unordered_map<string, uint32_t> ID_to_taxon_map;
+  if (! ID_to_taxon_map_filename.empty())
+    ID_to_taxon_map = read_seqid_to_taxid_map(ID_to_taxon_map_filename);
+
+  QuickFile db_file(DB_filename);
+  Database = KrakenDB(db_file.ptr());
+  KmerScanner::set_k(Database.get_k());
+  QuickFile idx_file(Index_filename);
+  KrakenDBIndex db_index(idx_file.ptr());
+  Database.set_index(&db_index);
+  uint8_t nt = db_index.indexed_nt();
+  if (nt > 16)
+    errx(EX_USAGE, "bin keys of more than 16 nt are not supported");
+
+  vector<KmerTaxid> kmers;
+  size_t merge_at = MIN_MERGE_KMERS;
+  uint32_t seqs_processed = 0, seqs_skipped = 0;
+  for (int i = optind; i < argc; i++) {
+    FastaReader reader(argv[i]);
+    while (reader.is_valid()) {
+      DNASequence dna = reader.next_sequence();
+      if (! reader.is_valid())
+        break;
+      if (dna.seq.empty())
+        continue;
+
+      // Get the taxid. If the header specifies kraken:taxid, use that
+      uint32_t taxid = 0;
+      auto it = ID_to_taxon_map.find(dna.id);
+      if (it != ID_to_taxon_map.end())
+        taxid = it->second;
+      else if (dna.id.compare(0, prefix.size(), prefix) == 0)
+        taxid = std::stol(dna.id.substr(prefix.size()));
+      if (taxid == 0 || Parent_map.find(taxid) == Parent_map.end()) {
+        cerr << "Skipping sequence " << dna.id << " - no taxonomy ID in the taxonomy database" << endl;
+        ++seqs_skipped;
+        continue;
+      }
+
+      add_kmers(kmers, taxid, dna.seq);
+      if (kmers.size() >= merge_at) {
+        sort_and_merge_new_kmers(kmers);
+        merge_at = max(MIN_MERGE_KMERS, 2 * kmers.size());
+      }
+      ++seqs_processed;
+      cerr << "\rProcessed " << seqs_processed << " sequences";
+    }
+  }
+  cerr << "\rFinished processing " << seqs_processed << " sequences (skipping "
+       << seqs_skipped << " sequences with no taxonomy mapping)" << endl;
+
+  cerr << "Sorting " << kmers.size() << " k-mers ..." << endl;
+  sort_and_merge_new_kmers(kmers);
+
+  cerr << "Merging " << kmers.size() << " distinct k-mers with the database ..." << endl;
+  QuickFile output_idx_file;
+  uint64_t *offsets = KrakenDB::create_index(output_idx_file, Output_index_filename, nt);
+  // The output offsets are computed first, to write the pairs in parallel
+  uint64_t entries = 1ull << (nt * 2);
+  memcpy(offsets, db_index.get_array(), (entries + 1) * sizeof(uint64_t));
+  vector<NewBin> new_bins;
+  for (uint64_t start = 0; start < kmers.size(); ) {
+    uint64_t end = start;
+    while (end < kmers.size() && kmers[end].bin_key == kmers[start].bin_key)
+      end++;
+    NewBin bin = { kmers[start].bin_key, start, end, 0 };
+    new_bins.push_back(bin);
+    start = end;
+  }
+  #pragma omp parallel for schedule(dynamic, 1024)
+  for (size_t b = 0; b < new_bins.size(); b++) {
+    NewBin &bin = new_bins[b];
+    for (uint64_t i = bin.start; i < bin.end; i++) {
+      if (Database.kmer_query(kmers[i].kmer) == NULL)
+        bin.added++;
+    }
+  }
+  uint64_t added = 0;
+  size_t next_new_bin = 0;
+  for (uint64_t i = 0; i <= entries; i++) {
+    offsets[i] += added;
+    while (next_new_bin < new_bins.size() && new_bins[next_new_bin].bin_key == i)
+      added += new_bins[next_new_bin++].added;
+  }
+  uint64_t key_ct = Database.get_key_ct() + added;
+  cerr << "Adding " << added << " k-mers to the " << Database.get_key_ct()
+       << " k-mers of the database." << endl;
+
+  vector<char> header = Database.make_header(key_ct);
+  QuickFile output_file(Output_DB_filename, "w", header.size() + key_ct * Database.pair_size());
+  memcpy(output_file.ptr(), header.data(), header.size());
+  merge_into_database(kmers, nt, offsets, output_file.ptr() + header.size());
+
+  if (! Kmer_count_filename.empty()) {
+    KrakenDB output_db(output_file.ptr());
+    ofstream ofs(Kmer_count_filename.c_str());
+    cerr << "Writing kmer counts to " << Kmer_count_filename << "..." << endl;
+    auto counts = output_db.count_taxons();
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+      ofs << it->first << '\t' << it->second << '\n';
+    }
+    ofs.close();
+  }
+  output_file.close_file();
+  output_idx_file.close_file();
+  return 0;
+}
+
+static unordered_map<string, uint32_t> read_seqid_to_taxid_map(string filename) {
+  unordered_map<string, uint32_t> ID_to_taxon_map;
+  ifstream map_file(filename.c_str());
+  if (map_file.rdstate() & ifstream::failbit) {
+    err(EX_NOINPUT, "can't open %s", filename.c_str());
+  }
+  string line, seq_id;
+  uint32_t taxid;
+  while (getline(map_file, line)) {
+    istringstream iss(line);
+    if (iss >> seq_id >> taxid)
+      ID_to_taxon_map.insert(make_pair(seq_id, taxid));
+  }
+  return ID_to_taxon_map;
+}
+
+// Collects the canonical k-mers of seq with their bin keys
+static void add_kmers(vector<KmerTaxid> &kmers, uint32_t taxid, string &seq) {
+  vector< vector<KmerTaxid> > piece_kmers((seq.size() + SKIP_LEN - 1) / SKIP_LEN);
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t p = 0; p < piece_kmers.size(); p++) {
+    KmerScanner scanner(seq, p * SKIP_LEN, (p + 1) * SKIP_LEN + Database.get_k() - 1);
+    uint64_t *kmer_ptr;
+    while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+      if (scanner.ambig_kmer())
+        continue;
+      uint64_t kmer = Database.canonical_representation(*kmer_ptr);
+      KmerTaxid kt = { kmer, (uint32_t) Database.bin_key(kmer), taxid };
+      piece_kmers[p].push_back(kt);
+    }
+  }
+  for (size_t p = 0; p < piece_kmers.size(); p++)
+    kmers.insert(kmers.end(), piece_kmers[p].begin(), piece_kmers[p].end());
+}
+
+// Sorts the new k-mers by bin and k-mer, and keeps each k-mer once with the
+// LCA of its taxids. The vector is shrunk to the remaining k-mers.
+static void sort_and_merge_new_kmers(vector<KmerTaxid> &kmers) {
+  sort(kmers.begin(), kmers.end(), [](const KmerTaxid &a, const KmerTaxid &b) {
+    return a.bin_key != b.bin_key ? a.bin_key < b.bin_key : a.kmer < b.kmer;
+  });
+  size_t n = 0;
+  for (size_t i = 0; i < kmers.size(); i++) {
+    if (n > 0 && kmers[n-1].kmer == kmers[i].kmer)
+      kmers[n-1].taxid = Taxonomy.lca(kmers[n-1].taxid, kmers[i].taxid);
+    else
+      kmers[n++] = kmers[i];
+  }
+  kmers.resize(n);
+  kmers.shrink_to_fit();
+}
+
+// The LCA is only meaningful for database values that are taxids. The
+// values of a UID database (set_lcas -I) are not in the taxonomy, or only
+// by chance, and such a database is rejected when they are found.
+static inline void check_taxid(const char *val_ptr) {
+  uint32_t val;
+  memcpy(&val, val_ptr, sizeof(val));
+  if (val != 0 && Parent_map.find(val) == Parent_map.end())
+    errx(EX_DATAERR, "database value %u is not a taxid of the taxonomy; UID databases are not supported", val);
+}
+
+// Writes the pairs of the database merged with the new k-mers. Each thread
+// takes a range of bins, and copies the pairs of the bins without new k-mers.
+static void merge_into_database(const vector<KmerTaxid> &kmers, uint8_t nt,
+                                uint64_t *offsets, char *output_pairs) {
+  uint64_t entries = 1ull << (nt * 2);
+  uint64_t *old_offsets = Database.get_index()->get_array();
+  uint64_t key_len = Database.get_key_len();
+  uint64_t pair_sz = Database.pair_size();
+  char *input_pairs = Database.get_pair_ptr();
+  int n_threads = max_threads();
+
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < n_threads; t++) {
+    uint64_t first_bin = entries * t / n_threads;
+    uint64_t last_bin = entries * (t + 1) / n_threads;
+    KmerTaxid first = { 0, (uint32_t) first_bin, 0 };
+    size_t k = lower_bound(kmers.begin(), kmers.end(), first, [](const KmerTaxid &a, const KmerTaxid &b) {
+      return a.bin_key < b.bin_key;
+    }) - kmers.begin();
+
+    uint64_t old_pos = old_offsets[first_bin];
+    uint64_t bin = first_bin;
+    while (bin < last_bin) {
+      // Copy the pairs up to the next bin with new k-mers
+      uint64_t next_bin = k < kmers.size() && kmers[k].bin_key < last_bin ? kmers[k].bin_key : last_bin;
+      uint64_t copy_end = old_offsets[next_bin];
+      memcpy(output_pairs + (offsets[bin] + old_pos - old_offsets[bin]) * pair_sz,
+             input_pairs + old_pos * pair_sz, (copy_end - old_pos) * pair_sz);
+      old_pos = copy_end;
+      bin = next_bin;
+      if (bin == last_bin)
+        break;
+
+      // Merge the bin with its new k-mers
+      char *out = output_pairs + offsets[bin] * pair_sz;
+      uint64_t old_end = old_offsets[bin + 1];
+      while (old_pos < old_end || (k < kmers.size() && kmers[k].bin_key == bin)) {
+        uint64_t old_kmer = 0;
+        if (old_pos < old_end)
+          memcpy(&old_kmer, input_pairs + old_pos * pair_sz, key_len);
+        bool take_new = k < kmers.size() && kmers[k].bin_key == bin;
+        if (take_new && old_pos < old_end && old_kmer <= kmers[k].kmer) {
+          check_taxid(input_pairs + old_pos * pair_sz + key_len);
+          memcpy(out, input_pairs + old_pos * pair_sz, pair_sz);
+          if (old_kmer == kmers[k].kmer) {
+            uint32_t *val_ptr = (uint32_t *) (out + key_len);
+            *val_ptr = Taxonomy.lca(*val_ptr, kmers[k].taxid);
+            if (verbose) {
+              #pragma omp critical(verbose_output)
+              cerr << "Updated k-mer of taxon " << kmers[k].taxid << " in the database" << endl;
+            }
+            k++;
+          }
+          old_pos++;
+        } else if (take_new) {
+          memcpy(out, &kmers[k].kmer, key_len);
+          memcpy(out + key_len, &kmers[k].taxid, sizeof(uint32_t));
+          k++;
+        } else {
+          check_taxid(input_pairs + old_pos * pair_sz + key_len);
+          memcpy(out, input_pairs + old_pos * pair_sz, pair_sz);
+          old_pos++;
+        }
+        out += pair_sz;
+      }
+      bin++;
+    }
+  }
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "d:i:o:O:b:m:c:t:vh")) != -1) {
+    switch (opt) {
+      case 'd' :
+        DB_filename = optarg;
+        break;
+      case 'i' :
+        Index_filename = optarg;
+        break;
+      case 'o' :
+        Output_DB_filename = optarg;
+        break;
+      case 'O' :
+        Output_index_filename = optarg;
+        break;
+      case 'b' :
+        TaxDB_filename = optarg;
+        break;
+      case 'm' :
+        ID_to_taxon_map_filename = optarg;
+        break;
+      case 'c' :
+        Kmer_count_filename = optarg;
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        Num_threads = sig;
+        omp_set_num_threads(Num_threads);
+        #endif
+        break;
+      case 'v' :
+        verbose = true;
+        break;
+      case 'h' :
+        usage(0);
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (DB_filename.empty() || Index_filename.empty() || TaxDB_filename.empty() ||
+      Output_DB_filename.empty() || Output_index_filename.empty() || optind == argc)
+    usage();
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: db_update [options] <FASTA file(s)>" << endl
+       << endl
+       << "Adds the k-mers of the sequences to a sorted LCA database, and sets the LCAs" << endl
+       << "of the k-mers that are already in it. UID databases (set_lcas -I) are not" << endl
+       << "supported." << endl
+       << endl
+       << "Options: (*mandatory)" << endl
+       << "* -d filename      Kraken DB filename" << endl
+       << "* -i filename      Kraken DB index filename" << endl
+       << "* -b filename      Taxonomy DB file" << endl
+       << "* -o filename      Output DB filename" << endl
+       << "* -O filename      Output DB index filename" << endl
+       << "  -m filename      Sequence ID to taxon map (default: kraken:taxid| in the headers)" << endl
+       << "  -c filename      Write k-mer counts of the output DB to filename" << endl
+       << "  -t #             Number of threads" << endl
+       << "  -v               Verbose output" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kraken_headers.hpp"
+#include "kraken_output.hpp"
+#include "quickfile.hpp"
+#include <iostream>
+
+using namespace std;
+using namespace kraken;
+
+// Flush the output buffer to STDOUT when it grows beyond this size
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "USAGE:\n"
+      << "dump_binary_output KRAKEN_OUTPUT [READ_IDS]\n"
+      << "\n"
+      << "Converts binary Kraken output (classify -b) to the standard text format.\n"
+      << "READ_IDS defaults to KRAKEN_OUTPUT.ids. When the output was written without\n"
+      << "hit lists (classify -H), the hit list column is 'NA'.\n";
+    return 1;
+  }
+
+  string output_filename = argv[1];
+  string ids_filename = argc == 3 ? argv[2] : output_filename + ".ids";
+
+  QuickFile output_file(output_filename);
+  const char *ptr = output_file.ptr();
+  const char *end = ptr + output_file.size();
+
+  BinaryOutputHeader header;
+  if (output_file.size() < sizeof(header) ||
+      strncmp(ptr, KRAKEN_BINARY_OUTPUT_STRING, strlen(KRAKEN_BINARY_OUTPUT_STRING))) {
+    errx(EX_DATAERR, "%s is not a binary Kraken output file", output_filename.c_str());
+  }
+  memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+  if (ptr == end)
+    return 0;
+
+  QuickFile ids_file(ids_filename);
+  const char *id_ptr = ids_file.ptr();
+  const char *id_end = id_ptr + ids_file.size();
+
+  string buf;
+  BinaryReadRecord record;
+  BinaryHitRun run;
+  while (ptr + sizeof(record) <= end) {
+    memcpy(&record, ptr, sizeof(record));
+    ptr += sizeof(record);
+
+    const char *id_stop = (const char *) memchr(id_ptr, '\n', id_end - id_ptr);
+    if (id_stop == NULL)
+      errx(EX_DATAERR, "more records in %s than read IDs in %s", output_filename.c_str(), ids_filename.c_str());
+
+    buf += record.taxid ? "C\t" : "U\t";
+    buf.append(id_ptr, id_stop - id_ptr);
+    buf += '\t';
+    append_uint(buf, record.taxid);
+    buf += '\t';
+    append_uint(buf, record.seq_len);
+    buf += '\t';
+    id_ptr = id_stop + 1;
+
+    if (header.flags & BINARY_OUTPUT_QUICK) {
+      buf += "Q:";
+      append_uint(buf, record.n_hits);
+    } else if (!(header.flags & BINARY_OUTPUT_HITLISTS)) {
+      buf += "NA";
+    } else if (record.n_runs == 0) {
+      buf += "0:0";
+    } else {
+      if (ptr + record.n_runs * sizeof(run) > end)
+        errx(EX_DATAERR, "truncated record in %s", output_filename.c_str());
+      for (uint32_t i = 0; i < record.n_runs; ++i) {
+        memcpy(&run, ptr, sizeof(run));
+        ptr += sizeof(run);
+        if (i > 0)
+          buf += ' ';
+        if (run.taxid == AMBIGUOUS_TAXON)
+          buf += 'A';
+        else
+          append_uint(buf, run.taxid);
+        buf += ':';
+        append_uint(buf, run.count);
+      }
+    }
+    buf += '\n';
+
+    if (buf.size() > OUTPUT_BUFFER_SIZE) {
+      cout.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  cout.write(buf.data(), buf.size());
+
+  if (ptr != end)
+    errx(EX_DATAERR, "trailing bytes in %s", output_filename.c_str());
+
+  return 0;
+}
@@ -27,15 +27,17 @@ using namespace std;
 using namespace kraken;
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  bool binary_output = argc == 3 && string(argv[1]) == "-b";
+  if (argc != 2 && !binary_output) {
     std::cerr << "USAGE:\n" 
-      << "dump_db_kmers DATABASE\n"
+      << "dump_db_kmers [-b] DATABASE\n"
       << "\n"
-      << "Dumps database k-mers as 64-bit numbers \n";
+      << "Dumps database k-mers as 64-bit numbers \n"
+      << "  -b   Write binary numbers (native byte order), e.g. for count_unique -b\n";
     return 1;
   }
 
-  char *db_name = argv[1];
+  char *db_name = argv[argc - 1];
   QuickFile db_file;
   db_file.open_file(db_name);
   //db_file.load_file();
@@ -55,7 +57,10 @@ int main(int argc, char **argv) {
   }
   for (uint64_t i = 0; i < key_ct; i++) {
     uint64_t* kmer = (uint64_t *) (ptr + pair_sz * i);
-    cout << *kmer << '\n';
+    if (binary_output)
+      cout.write((const char*) kmer, sizeof(uint64_t));
+    else
+      cout << *kmer << '\n';
   }
 }
 
@@ -28,6 +28,14 @@
 #include<algorithm> //vector.count
 #include<bitset>
 #include<numeric>   //accummulate
+#include<limits>
+#include<mutex>
+#include<cstring>   //memcpy
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HLL_AVX2_KERNELS
+#include<immintrin.h>
+#endif
 
 #include "hyperloglogplus-bias.hpp"
 #include "assert_helpers.h"
@@ -99,6 +107,20 @@ T extractBits(T value, uint8_t hi, uint8_t lo, bool shift_left = false) {
     return result;  
 }
 
+/**
+ * 64-bit finalizer of MurmurHash3, see murmurhash3_finalizer. Defined here
+ * so that the batch insert can inline it.
+ */
+static inline uint64_t murmurhash3_mix(uint64_t key) {
+  key += 1; // murmurhash returns a hash value of 0 for the key 0 - avoid that.
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccd;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53;
+  key ^= key >> 33;
+  return key;
+}
+
 inline uint64_t extractHighBits(uint64_t bits, uint8_t hi) {
   return bits >> (64u - hi);
 }
@@ -229,11 +251,134 @@ void addHashToSparseList(vector<uint32_t>& vec, const uint32_t val, const uint8_
   //}
 }
 
-template<typename SET>
-inline 
-void addHashToSparseList(SET& uset, const uint32_t val, const uint8_t /*pPrime*/) {
-  // this implementation currently does not check if there is a value for an index of length pPrime
-  uset.insert(val);
+/////////////////////////////////////////////////////////////////////
+// SparseList methods
+
+vector<uint32_t> SparseList::decode() const {
+  vector<uint32_t> values;
+  values.reserve(n_values);
+  uint32_t val = 0;
+  size_t pos = 0;
+  for (size_t i = 0; i < n_values; ++i) {
+    uint32_t delta = 0;
+    for (uint8_t shift = 0; ; shift += 7) {
+      uint8_t byte = encoded[pos++];
+      delta |= uint32_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    val += delta;
+    values.push_back(val);
+  }
+  return values;
+}
+
+// values have to be sorted and distinct
+void SparseList::encode(const vector<uint32_t>& values) {
+  encoded.clear();
+  uint32_t prev = 0;
+  for (size_t i = 0; i < values.size(); ++i) {
+    uint32_t delta = values[i] - prev;
+    prev = values[i];
+    while (delta >= 0x80) {
+      encoded.push_back(uint8_t(delta) | 0x80);
+      delta >>= 7;
+    }
+    encoded.push_back(uint8_t(delta));
+  }
+  n_values = values.size();
+  encoded.shrink_to_fit();
+}
+
+void SparseList::flush() {
+  if (buffer.empty())
+    return;
+  std::sort(buffer.begin(), buffer.end());
+  buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+  if (n_values == 0) {
+    encode(buffer);
+  } else {
+    vector<uint32_t> values = decode();
+    vector<uint32_t> merged;
+    merged.reserve(values.size() + buffer.size());
+    std::set_union(values.begin(), values.end(), buffer.begin(), buffer.end(), std::back_inserter(merged));
+    encode(merged);
+  }
+  buffer.clear();
+}
+
+void SparseList::insert(const SparseList& other) {
+  vector<uint32_t> other_values;
+  other_values.reserve(other.n_values + other.buffer.size());
+  other.for_each([&other_values](uint32_t val) { other_values.push_back(val); });
+  if (other_values.empty())
+    return;
+  flush();
+  if (n_values == 0) {
+    encode(other_values);
+  } else {
+    vector<uint32_t> values = decode();
+    vector<uint32_t> merged;
+    merged.reserve(values.size() + other_values.size());
+    std::set_union(values.begin(), values.end(), other_values.begin(), other_values.end(), std::back_inserter(merged));
+    encode(merged);
+  }
+}
+
+void SparseList::clear() {
+  encoded.clear();
+  encoded.shrink_to_fit();
+  n_values = 0;
+  buffer.clear();
+}
+
+template<typename T>
+static void writeValue(ostream& os, const T& val) {
+  os.write((const char*) &val, sizeof(T));
+}
+
+template<typename T>
+static T readValue(istream& is) {
+  T val;
+  if (!is.read((char*) &val, sizeof(T)))
+    throw std::runtime_error("truncated HLL sketch");
+  return val;
+}
+
+void SparseList::write(ostream& os) const {
+  writeValue<uint64_t>(os, n_values);
+  writeValue<uint64_t>(os, encoded.size());
+  os.write((const char*) encoded.data(), encoded.size());
+  writeValue<uint64_t>(os, buffer.size());
+  os.write((const char*) buffer.data(), buffer.size() * sizeof(uint32_t));
+}
+
+void SparseList::read(istream& is) {
+  n_values = readValue<uint64_t>(is);
+  encoded.resize(readValue<uint64_t>(is));
+  if (encoded.size() < n_values)
+    throw std::runtime_error("malformed HLL sparse list");
+  if (!is.read((char*) encoded.data(), encoded.size()))
+    throw std::runtime_error("truncated HLL sketch");
+  // each value ends with a byte without continuation bit
+  size_t n_ends = 0;
+  for (size_t i = 0; i < encoded.size(); ++i)
+    n_ends += !(encoded[i] & 0x80);
+  if (n_ends != n_values || (!encoded.empty() && (encoded.back() & 0x80)))
+    throw std::runtime_error("malformed HLL sparse list");
+  buffer.resize(readValue<uint64_t>(is));
+  if (buffer.size() > BUFFER_SIZE)
+    throw std::runtime_error("malformed HLL sparse list");
+  if (!is.read((char*) buffer.data(), buffer.size() * sizeof(uint32_t)))
+    throw std::runtime_error("truncated HLL sketch");
+}
+
+size_t SparseList::size() const {
+  if (buffer.empty())
+    return n_values;
+  size_t n = 0;
+  for_each([&n](uint32_t) { ++n; });
+  return n;
 }
 
 
@@ -272,19 +417,367 @@ double linearCounting(const uint32_t m, const uint32_t v) {
 }
 
 
+/////////////////////////////////////////////////////////////////////
+// Register storage
+
+// Register blocks of 2^MIN_POOLED_BITS to 2^MAX_POOLED_BITS bytes are pooled
+static const size_t MIN_POOLED_BITS = 4;
+static const size_t MAX_POOLED_BITS = 18;
+static const size_t SLAB_SIZE = 1 << 20;
+
+struct RegisterPool {
+  std::mutex mutex;
+  vector<void*> free_blocks[MAX_POOLED_BITS + 1];
+};
+
+// Never destroyed, so that sketches in static storage can still release their registers
+static RegisterPool& registerPool() {
+  static RegisterPool* pool = new RegisterPool();
+  return *pool;
+}
+
+// Returns the size class of n_bytes, or 0 if blocks of this size are not pooled
+static size_t registerSizeBits(size_t n_bytes) {
+  if (n_bytes < (1u << MIN_POOLED_BITS) || n_bytes > (1u << MAX_POOLED_BITS) || (n_bytes & (n_bytes - 1)))
+    return 0;
+  return __builtin_ctzll(n_bytes);
+}
+
+void* allocateRegisters(size_t n_bytes) {
+  size_t bits = registerSizeBits(n_bytes);
+  if (bits == 0)
+    return ::operator new(n_bytes);
+
+  RegisterPool& pool = registerPool();
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  vector<void*>& free_blocks = pool.free_blocks[bits];
+  if (free_blocks.empty()) {
+    char* slab = static_cast<char*>(::operator new(SLAB_SIZE));
+    for (size_t offset = SLAB_SIZE; offset > 0; offset -= n_bytes)
+      free_blocks.push_back(slab + offset - n_bytes);
+  }
+  void* ptr = free_blocks.back();
+  free_blocks.pop_back();
+  return ptr;
+}
+
+void releaseRegisters(void* ptr, size_t n_bytes) {
+  size_t bits = registerSizeBits(n_bytes);
+  if (bits == 0) {
+    ::operator delete(ptr);
+    return;
+  }
+
+  RegisterPool& pool = registerPool();
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  pool.free_blocks[bits].push_back(ptr);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Register kernels
+//  Merging and histogramming the dense registers is done for every clade of
+//  a report and every merged sample. The AVX2 versions of these loops are
+//  selected at runtime if the CPU supports them.
+
+// Register values are at most q+1 = 65-p
+static const size_t MAX_REGISTER_VALUE = 64;
+
+static void maxRegistersScalar(uint8_t* dst, const uint8_t* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (src[i] > dst[i]) {
+      dst[i] = src[i];
+    }
+  }
+}
+
+// Adds the counts of the register values in M to C
+static void histogramScalar(const uint8_t* M, size_t n, uint32_t* C) {
+  // four partial histograms, so that runs of equal values do not wait on the same counter
+  uint32_t C4[4][MAX_REGISTER_VALUE] = {};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    ++C4[0][M[i]];
+    ++C4[1][M[i+1]];
+    ++C4[2][M[i+2]];
+    ++C4[3][M[i+3]];
+  }
+  for (; i < n; ++i) {
+    ++C4[0][M[i]];
+  }
+  for (size_t k = 0; k < MAX_REGISTER_VALUE; ++k) {
+    C[k] += C4[0][k] + C4[1][k] + C4[2][k] + C4[3][k];
+  }
+}
+
+// 6-bit packed registers (see below) are stored in groups of four registers
+// in three bytes
+static inline uint32_t loadPackedGroup(const uint8_t* group) {
+  return group[0] | (uint32_t(group[1]) << 8) | (uint32_t(group[2]) << 16);
+}
+
+static inline void storePackedGroup(uint8_t* group, uint32_t w) {
+  group[0] = uint8_t(w);
+  group[1] = uint8_t(w >> 8);
+  group[2] = uint8_t(w >> 16);
+}
+
+// The four 6-bit registers of a group, spread to the four bytes of a 32-bit word
+static inline uint32_t spreadPackedGroup(uint32_t w) {
+  return (w & 0x3F) | ((w << 2) & 0x3F00) | ((w << 4) & 0x3F0000) | ((w << 6) & 0x3F000000);
+}
+
+static inline uint32_t gatherPackedGroup(uint32_t v) {
+  return (v & 0x3F) | ((v >> 2) & 0xFC0) | ((v >> 4) & 0x3F000) | ((v >> 6) & 0xFC0000);
+}
+
+// Unpacks the registers of n_groups groups of four, starting at first_group, to out
+static void unpackRegistersScalar(const uint8_t* P, size_t first_group, size_t n_groups, uint8_t* out) {
+  const uint8_t* group = P + first_group * 3;
+  for (size_t i = 0; i < n_groups; ++i, group += 3, out += 4) {
+    uint32_t v = spreadPackedGroup(loadPackedGroup(group));
+    memcpy(out, &v, 4);
+  }
+}
+
+// Packs the registers of n_groups groups of four from in, starting at first_group
+static void packRegistersScalar(const uint8_t* in, size_t first_group, size_t n_groups, uint8_t* P) {
+  uint8_t* group = P + first_group * 3;
+  for (size_t i = 0; i < n_groups; ++i, group += 3, in += 4) {
+    uint32_t v;
+    memcpy(&v, in, 4);
+    storePackedGroup(group, gatherPackedGroup(v));
+  }
+}
+
+#ifdef HLL_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void maxRegistersAVX2(uint8_t* dst, const uint8_t* src, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_max_epu8(a, b));
+  }
+  maxRegistersScalar(dst + i, src + i, n - i);
+}
+
+// Counts each value between the minimum and maximum register value with
+// byte-wise compares. The registers of a dense sketch span only a narrow
+// range of values, so this takes few passes over M.
+__attribute__((target("avx2")))
+static void histogramAVX2(const uint8_t* M, size_t n, uint32_t* C) {
+  size_t n_vec = n - n % 32;
+  if (n_vec == 0) {
+    histogramScalar(M, n, C);
+    return;
+  }
+
+  __m256i vmin = _mm256_set1_epi8(-1);
+  __m256i vmax = _mm256_setzero_si256();
+  for (size_t i = 0; i < n_vec; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(M + i));
+    vmin = _mm256_min_epu8(vmin, x);
+    vmax = _mm256_max_epu8(vmax, x);
+  }
+  uint8_t mins[32], maxs[32];
+  _mm256_storeu_si256((__m256i*)mins, vmin);
+  _mm256_storeu_si256((__m256i*)maxs, vmax);
+  uint8_t lo = *std::min_element(mins, mins + 32);
+  uint8_t hi = *std::max_element(maxs, maxs + 32);
+
+  // count four values per pass over M
+  const __m256i zero = _mm256_setzero_si256();
+  for (unsigned v = lo; v <= hi; v += 4) {
+    const __m256i t0 = _mm256_set1_epi8((char)v);
+    const __m256i t1 = _mm256_set1_epi8((char)(v+1));
+    const __m256i t2 = _mm256_set1_epi8((char)(v+2));
+    const __m256i t3 = _mm256_set1_epi8((char)(v+3));
+    uint64_t counts[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < n_vec; ) {
+      // byte counters overflow after 255 iterations
+      size_t block_end = std::min(n_vec, i + 255*32);
+      __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+      for (; i < block_end; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(M + i));
+        acc0 = _mm256_sub_epi8(acc0, _mm256_cmpeq_epi8(x, t0));
+        acc1 = _mm256_sub_epi8(acc1, _mm256_cmpeq_epi8(x, t1));
+        acc2 = _mm256_sub_epi8(acc2, _mm256_cmpeq_epi8(x, t2));
+        acc3 = _mm256_sub_epi8(acc3, _mm256_cmpeq_epi8(x, t3));
+      }
+      const __m256i accs[4] = {acc0, acc1, acc2, acc3};
+      for (size_t j = 0; j < 4; ++j) {
+        __m256i sums = _mm256_sad_epu8(accs[j], zero);
+        counts[j] += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                     _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+      }
+    }
+    for (size_t j = 0; j < 4 && v + j < MAX_REGISTER_VALUE; ++j) {
+      C[v + j] += counts[j];
+    }
+  }
+  histogramScalar(M + n_vec, n - n_vec, C);
+}
+
+// Unpacks eight groups (24 bytes) at a time: the bytes of each group are
+// shuffled into a 32-bit lane, and the registers spread to its four bytes.
+__attribute__((target("avx2")))
+static void unpackRegistersAVX2(const uint8_t* P, size_t first_group, size_t n_groups, uint8_t* out) {
+  const uint8_t* group = P + first_group * 3;
+  const __m256i shuffle = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                           0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+  size_t i = 0;
+  // the second 16 byte load reads 4 bytes beyond the eight groups
+  for (; i + 10 <= n_groups; i += 8, group += 24, out += 32) {
+    __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)group)),
+                                        _mm_loadu_si128((const __m128i*)(group + 12)), 1);
+    __m256i w = _mm256_shuffle_epi8(x, shuffle);
+    __m256i v = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(w, _mm256_set1_epi32(0x3F)),
+                        _mm256_and_si256(_mm256_slli_epi32(w, 2), _mm256_set1_epi32(0x3F00))),
+        _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi32(w, 4), _mm256_set1_epi32(0x3F0000)),
+                        _mm256_and_si256(_mm256_slli_epi32(w, 6), _mm256_set1_epi32(0x3F000000))));
+    _mm256_storeu_si256((__m256i*)out, v);
+  }
+  unpackRegistersScalar(P, first_group + i, n_groups - i, out);
+}
+
+__attribute__((target("avx2")))
+static void packRegistersAVX2(const uint8_t* in, size_t first_group, size_t n_groups, uint8_t* P) {
+  uint8_t* group = P + first_group * 3;
+  const __m256i shuffle = _mm256_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1,
+                                           0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+  size_t i = 0;
+  // each 16 byte store writes 4 bytes beyond its groups, which are overwritten afterwards
+  for (; i + 10 <= n_groups; i += 8, group += 24, in += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)in);
+    __m256i w = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi32(0x3F)),
+                        _mm256_and_si256(_mm256_srli_epi32(v, 2), _mm256_set1_epi32(0xFC0))),
+        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi32(0x3F000)),
+                        _mm256_and_si256(_mm256_srli_epi32(v, 6), _mm256_set1_epi32(0xFC0000))));
+    w = _mm256_shuffle_epi8(w, shuffle);
+    _mm_storeu_si128((__m128i*)group, _mm256_castsi256_si128(w));
+    _mm_storeu_si128((__m128i*)(group + 12), _mm256_extracti128_si256(w, 1));
+  }
+  packRegistersScalar(in, first_group + i, n_groups - i, P);
+}
+#endif
+
+static void (*maxRegisters)(uint8_t*, const uint8_t*, size_t) = maxRegistersScalar;
+static void (*histogram)(const uint8_t*, size_t, uint32_t*) = histogramScalar;
+static void (*unpackRegisters)(const uint8_t*, size_t, size_t, uint8_t*) = unpackRegistersScalar;
+static void (*packRegisters)(const uint8_t*, size_t, size_t, uint8_t*) = packRegistersScalar;
+
+bool hll_use_simd_kernels(bool enable) {
+  bool use_avx2 = false;
+#ifdef HLL_AVX2_KERNELS
+  __builtin_cpu_init();
+  use_avx2 = enable && __builtin_cpu_supports("avx2");
+  if (use_avx2) {
+    maxRegisters = maxRegistersAVX2;
+    histogram = histogramAVX2;
+    unpackRegisters = unpackRegistersAVX2;
+    packRegisters = packRegistersAVX2;
+    return true;
+  }
+#endif
+  maxRegisters = maxRegistersScalar;
+  histogram = histogramScalar;
+  unpackRegisters = unpackRegistersScalar;
+  packRegisters = packRegistersScalar;
+  return use_avx2;
+}
+
+static bool use_simd_kernels = hll_use_simd_kernels(true);
+
+/////////////////////////////////////////////////////////////////////
+// Packed registers
+//  Dense sketches can store their registers with 6 bits each, four registers
+//  in three bytes, which takes 25% less memory. Register values are at most
+//  65-p, so they fit. Merging and the estimators unpack chunks of registers
+//  and use the kernels above on them.
+//  Packing is the default when compiled with -DHLL_PACKED_REGISTERS, and can
+//  be switched with hll_use_packed_registers().
+
+#ifdef HLL_PACKED_REGISTERS
+static bool use_packed_registers = true;
+#else
+static bool use_packed_registers = false;
+#endif
+
+void hll_use_packed_registers(bool enable) {
+  use_packed_registers = enable;
+}
+
+// Number of registers that are unpacked at once
+static const size_t UNPACK_CHUNK_SIZE = 1024;
+
+// Number of bytes for m registers
+static size_t registerBytes(size_t m, bool packed) {
+  return packed ? m / 4 * 3 : m;
+}
+
+static inline uint8_t getPackedRegister(const uint8_t* P, size_t idx) {
+  return (loadPackedGroup(P + (idx >> 2) * 3) >> (6 * (idx & 3))) & 63;
+}
+
+static inline void setPackedRegister(uint8_t* P, size_t idx, uint8_t val) {
+  uint8_t* group = P + (idx >> 2) * 3;
+  unsigned shift = 6 * (idx & 3);
+  storePackedGroup(group, (loadPackedGroup(group) & ~(uint32_t(63) << shift)) | (uint32_t(val) << shift));
+}
+
+// Histogram of the m register values, with MAX_REGISTER_VALUE entries
+static vector<uint32_t> registerValueCounts(const RegisterVector& M, bool packed, size_t m) {
+  vector<uint32_t> C(MAX_REGISTER_VALUE, 0);
+  if (!packed) {
+    histogram(M.data(), m, C.data());
+    return C;
+  }
+  uint8_t buf[UNPACK_CHUNK_SIZE];
+  for (size_t group = 0; group < m / 4; group += UNPACK_CHUNK_SIZE / 4) {
+    size_t n_groups = std::min(UNPACK_CHUNK_SIZE / 4, m / 4 - group);
+    unpackRegisters(M.data(), group, n_groups, buf);
+    histogram(buf, n_groups * 4, C.data());
+  }
+  return C;
+}
+
+// Sets the m registers of dst to the maximum of those of dst and src
+static void mergeRegisters(RegisterVector& dst, bool dst_packed, const RegisterVector& src, bool src_packed, size_t m) {
+  if (!dst_packed && !src_packed) {
+    maxRegisters(dst.data(), src.data(), m);
+    return;
+  }
+  uint8_t dst_buf[UNPACK_CHUNK_SIZE], src_buf[UNPACK_CHUNK_SIZE];
+  for (size_t group = 0; group < m / 4; group += UNPACK_CHUNK_SIZE / 4) {
+    size_t n_groups = std::min(UNPACK_CHUNK_SIZE / 4, m / 4 - group);
+    const uint8_t* src_regs = src.data() + group * 4;
+    if (src_packed) {
+      unpackRegisters(src.data(), group, n_groups, src_buf);
+      src_regs = src_buf;
+    }
+    if (dst_packed) {
+      unpackRegisters(dst.data(), group, n_groups, dst_buf);
+      maxRegisters(dst_buf, src_regs, n_groups * 4);
+      packRegisters(dst_buf, group, n_groups, dst.data());
+    } else {
+      maxRegisters(dst.data() + group * 4, src_regs, n_groups * 4);
+    }
+  }
+}
+
 /**
- * calculate the raw estimate as harmonic mean of the ranks in the register
+ * calculate the raw estimate as harmonic mean of the ranks in the register,
+ * from the histogram C of the m register values
  */
-inline double calculateRawEstimate(const vector<uint8_t>& M) {
+inline double calculateRawEstimate(const vector<uint32_t>& C, size_t m) {
   double inverseSum = 0.0;
-  for (size_t i = 0; i < M.size(); ++i) {
-    inverseSum += 1. / (1ull << M[i]);
+  for (size_t k = 0; k < C.size(); ++k) {
+    if (C[k] > 0)
+      inverseSum += double(C[k]) / (1ull << k);
   }
-  return alpha(M.size()) * double(M.size() * M.size()) * 1. / inverseSum;
-}
-
-uint32_t countZeros(vector<uint8_t> s) {
-  return (uint32_t)count(s.begin(), s.end(), 0);
+  return alpha(m) * double(m * m) * 1. / inverseSum;
 }
 
 
@@ -327,14 +820,13 @@ double getEstimateBias(double estimate, uint8_t p) {
  *  it's size is q+1 = 64-p+1
  * used in Ertl's improved estimator
  */
-vector<int> registerHistogram(const vector<uint8_t>& M, uint8_t q) {
-    vector<int> C(q+2, 0);
-    for (size_t i = 0; i < M.size(); ++i) {
-      if (M[i] >= q+1) {
-        cerr << "M["<<i<<"] == " << M[i] << "! larger than " << (q+1) << endl;
+vector<int> registerHistogram(const vector<uint32_t>& counts, uint8_t q) {
+    for (size_t k = q+2; k < counts.size(); ++k) {
+      if (counts[k] > 0) {
+        cerr << "M has " << counts[k] << " registers with value " << k << "! larger than " << (q+1) << endl;
       }
-      ++C[M[i]]; 
     }
+    vector<int> C(counts.begin(), counts.begin() + q+2);
     #ifdef HLL_DEBUG
     cerr << "C = {";
     for (size_t i = 0; i < C.size(); ++i) {
@@ -342,18 +834,17 @@ vector<int> registerHistogram(const vector<uint8_t>& M, uint8_t q) {
     }
     cerr << "}" << endl;
     #endif
-    assert_eq((size_t)std::accumulate(C.begin(), C.end(), 0), M.size());
     return C;
 }
 
 vector<int> sparseRegisterHistogram(const SparseListType& sparseList, uint8_t pPrime, uint8_t p, uint8_t q){
     vector<int> C(q+2, 0);
     size_t m = 1 << pPrime;
-    for (const auto& encoded_hash_value : sparseList) {
+    sparseList.for_each([&](uint32_t encoded_hash_value) {
       uint8_t rank_val = getEncodedRank(encoded_hash_value, pPrime, p);
       ++C[rank_val]; 
       --m;
-    }
+    });
     C[0] = m;
     return C;
 }
@@ -417,18 +908,27 @@ double tau(double x) {
 /////////////////////////////////////////////////////////////////////
 // HyperLogLogPlusMinus class methods
 
+template<typename T>
+inline void HyperLogLogPlusMinus<T>::updateRegister(uint32_t idx, uint8_t rank) {
+    if (packed) {
+      if (rank > getPackedRegister(M.data(), idx))
+        setPackedRegister(M.data(), idx, rank);
+    } else if (rank > M[idx]) {
+      M[idx] = rank;
+    }
+}
+
 template<>
 HyperLogLogPlusMinus<uint64_t>::HyperLogLogPlusMinus(uint8_t precision, bool sparse, uint64_t  (*bit_mixer) (uint64_t)):
-      p(precision), m(1<<precision), sparse(sparse), bit_mixer(bit_mixer) {
+      p(precision), m(1<<precision), sparse(sparse), packed(use_packed_registers), bit_mixer(bit_mixer) {
     if (precision > 18 || precision < 4) {
           throw std::invalid_argument("precision (number of register = 2^precision) must be between 4 and 18");
     }
 
     if (sparse) {
-      this->sparseList = SparseListType(); // TODO: if SparseListType is changed, initialize with appropriate size
-      this->sparseList.reserve(m/4);
+      this->sparseList = SparseListType();
     } else {
-      this->M = vector<uint8_t>(m);
+      this->M = RegisterVector(registerBytes(m, packed));
     }
 }
 
@@ -439,6 +939,7 @@ HyperLogLogPlusMinus<HASH>& HyperLogLogPlusMinus<HASH>::operator= (HyperLogLogPl
   M = std::move(other.M);
   n_observed = other.n_observed;
   sparse = other.sparse;
+  packed = other.packed;
   sparseList = std::move(other.sparseList);
   bit_mixer = other.bit_mixer;
   return *this;
@@ -451,6 +952,7 @@ HyperLogLogPlusMinus<HASH>& HyperLogLogPlusMinus<HASH>::operator= (const HyperLo
   M = other.M;
   n_observed = other.n_observed;
   sparse = other.sparse;
+  packed = other.packed;
   sparseList = other.sparseList;
   bit_mixer = other.bit_mixer;
   return *this;
@@ -459,7 +961,7 @@ HyperLogLogPlusMinus<HASH>& HyperLogLogPlusMinus<HASH>::operator= (const HyperLo
 template<typename HASH>
 HyperLogLogPlusMinus<HASH>::HyperLogLogPlusMinus(const HyperLogLogPlusMinus<HASH>& other):
       p(other.p), m(other.m), 
-      M(other.M), n_observed(other.n_observed), sparse(other.sparse), 
+      M(other.M), n_observed(other.n_observed), sparse(other.sparse), packed(other.packed),
       sparseList(other.sparseList), 
       bit_mixer(other.bit_mixer) {
 }
@@ -469,7 +971,7 @@ template<typename HASH>
 HyperLogLogPlusMinus<HASH>::HyperLogLogPlusMinus(HyperLogLogPlusMinus<HASH>&& other):
       p(other.p), m(other.m), 
       M(std::move(other.M)), 
-      n_observed(other.n_observed), sparse(other.sparse), 
+      n_observed(other.n_observed), sparse(other.sparse), packed(other.packed),
       sparseList(std::move(other.sparseList)), 
       bit_mixer(other.bit_mixer) {
 }
@@ -486,13 +988,10 @@ void HyperLogLogPlusMinus<uint64_t>::add(uint64_t item) {
     cerr << bitset<64>(hash_value) << endl;
 #endif
 
-    if (sparse && this->sparseList.size() + 1 > this->m/4) {
-       switchToNormalRepresentation();
-     }
     if (sparse) {
       // sparse mode: put the encoded hash into sparse list
       uint32_t encoded_hash_value = encodeHashIn32Bit(hash_value, pPrime, p);
-      addHashToSparseList(sparseList, encoded_hash_value, pPrime);
+      addToSparseList(encoded_hash_value);
 
 #ifdef HLL_DEBUG2
       cerr << "encoded hash:   " << bitset<32>(encoded_hash_value) << endl;
@@ -500,7 +999,6 @@ void HyperLogLogPlusMinus<uint64_t>::add(uint64_t item) {
       assert_eq(getEncodedRank(encoded_hash_value,pPrime,p), getRank(hash_value, p));
 #endif
 
-      // if the sparseList is too large, switch to normal (register) representation
     } else {
       // normal mode
       // take first p bits as index  {x63,...,x64-p}
@@ -509,19 +1007,111 @@ void HyperLogLogPlusMinus<uint64_t>::add(uint64_t item) {
       uint8_t rank = getRank(hash_value, p);
 
       // update the register if current rank is bigger
-      if (rank > this->M[idx]) {
-        this->M[idx] = rank;
-      }
+      updateRegister(idx, rank);
     }
 }
 
 template <typename T>
-void HyperLogLogPlusMinus<T>::add(vector<uint64_t> items) {
-    for(size_t i = 0; i < items.size(); ++i) {
-      this->add(items[i]);
+void HyperLogLogPlusMinus<T>::add(const vector<uint64_t>& items) {
+    this->add(items.data(), items.size());
+}
+
+// Batch insert: each chunk of items is first hashed, with the inlined mixer
+// when the default murmurhash3_finalizer is used, then encoded into sparse
+// values or register indexes and ranks, and then added to the sparse list
+// or registers. The result is the same as adding the items one by one.
+template<>
+void HyperLogLogPlusMinus<uint64_t>::add(const uint64_t* items, size_t n_items) {
+    static const size_t CHUNK_SIZE = 256;
+    uint64_t hashes[CHUNK_SIZE];
+    uint32_t codes[CHUNK_SIZE];  // encoded hash values or register indexes
+    uint8_t ranks[CHUNK_SIZE];
+
+    for (size_t start = 0; start < n_items; start += CHUNK_SIZE) {
+      const size_t len = std::min(CHUNK_SIZE, n_items - start);
+      const uint64_t* chunk = items + start;
+      if (bit_mixer == murmurhash3_finalizer) {
+        for (size_t i = 0; i < len; ++i)
+          hashes[i] = murmurhash3_mix(chunk[i]);
+      } else {
+        for (size_t i = 0; i < len; ++i)
+          hashes[i] = bit_mixer(chunk[i]);
+      }
+      n_observed += len;
+
+      size_t i = 0;
+      if (sparse) {
+        for (size_t j = 0; j < len; ++j)
+          codes[j] = encodeHashIn32Bit(hashes[j], pPrime, p);
+        // the sparse list may get too large within the chunk
+        for (; i < len && sparse; ++i)
+          addToSparseList(codes[i]);
+      }
+      if (!sparse) {
+        for (size_t j = i; j < len; ++j) {
+          codes[j] = getIndex(hashes[j], p);
+          ranks[j] = getRank(hashes[j], p);
+        }
+        if (packed) {
+          for (size_t j = i; j < len; ++j)
+            updateRegister(codes[j], ranks[j]);
+        } else {
+          for (size_t j = i; j < len; ++j) {
+            if (ranks[j] > this->M[codes[j]])
+              this->M[codes[j]] = ranks[j];
+          }
+        }
+      }
     }
 }
 
+template<typename T>
+void HyperLogLogPlusMinus<T>::write(ostream& os) const {
+  writeValue<uint8_t>(os, p);
+  writeValue<uint8_t>(os, sparse);
+  writeValue<uint64_t>(os, n_observed);
+  if (sparse) {
+    sparseList.write(os);
+  } else if (packed) {
+    // registers are always written unpacked
+    RegisterVector regs(m);
+    unpackRegisters(M.data(), 0, m / 4, regs.data());
+    os.write((const char*) regs.data(), m);
+  } else {
+    os.write((const char*) M.data(), m);
+  }
+}
+
+template<typename T>
+void HyperLogLogPlusMinus<T>::read(istream& is) {
+  uint8_t precision = readValue<uint8_t>(is);
+  if (precision > 18 || precision < 4)
+    throw std::runtime_error("malformed HLL sketch: invalid precision");
+  p = precision;
+  m = 1 << p;
+  sparse = readValue<uint8_t>(is);
+  n_observed = readValue<uint64_t>(is);
+  if (sparse) {
+    M.clear();
+    sparseList.read(is);
+  } else {
+    sparseList.clear();
+    RegisterVector regs(m);
+    if (!is.read((char*) regs.data(), m))
+      throw std::runtime_error("truncated HLL sketch");
+    for (size_t i = 0; i < m; ++i) {
+      if (regs[i] > 65 - p)
+        throw std::runtime_error("malformed HLL sketch: invalid register value");
+    }
+    if (packed) {
+      M = RegisterVector(registerBytes(m, packed));
+      packRegisters(regs.data(), 0, m / 4, M.data());
+    } else {
+      M = std::move(regs);
+    }
+  }
+}
+
 // reset to original state
 template <typename T>
 void HyperLogLogPlusMinus<T>::reset() {
@@ -530,6 +1120,17 @@ void HyperLogLogPlusMinus<T>::reset() {
     this->M.clear();
 }
 
+// Add an encoded hash to the sparse list, and switch to normal (register)
+// representation if the list is too large. The size is only checked when the
+// insert buffer has been merged into the list, so the list may exceed m/4 by
+// less than BUFFER_SIZE values, but repeated values never cause a merge.
+template <typename T>
+void HyperLogLogPlusMinus<T>::addToSparseList(uint32_t encoded_hash_value) {
+    sparseList.insert(encoded_hash_value);
+    if (sparseList.buffered() == 0 && sparseList.size() > this->m/4)
+      switchToNormalRepresentation();
+}
+
 // Convert from sparse representation (using sparseList) to normal (using register)
 template <typename T>
 void HyperLogLogPlusMinus<T>::switchToNormalRepresentation() {
@@ -540,7 +1141,7 @@ void HyperLogLogPlusMinus<T>::switchToNormalRepresentation() {
     cerr << " est before: " << cardinality() << endl;
 #endif
     this->sparse = false;
-    this->M = vector<uint8_t>(this->m);
+    this->M = RegisterVector(registerBytes(this->m, packed));
     addToRegisters(this->sparseList);
     this->sparseList.clear();
 #ifdef HLL_DEBUG
@@ -555,18 +1156,12 @@ void HyperLogLogPlusMinus<T>::addToRegisters(const SparseListType &sparseList) {
       cerr << "Cannot add to registers of a sparse HLL" << endl;
       return;
     }
-    if (sparseList.size() == 0) {
-      return;
-    }
-    for (auto encoded_hash_value_ptr = sparseList.begin(); encoded_hash_value_ptr != sparseList.end(); ++encoded_hash_value_ptr) {
-
-      size_t idx = getIndex(*encoded_hash_value_ptr, p);
-      assert_lt(idx,M.size());
-      uint8_t rank_val = getEncodedRank(*encoded_hash_value_ptr, pPrime, p);
-      if (rank_val > this->M[idx]) {
-        this->M[idx] = rank_val;
-      }
-    }
+    sparseList.for_each([this](uint32_t encoded_hash_value) {
+      size_t idx = getIndex(encoded_hash_value, p);
+      assert_lt(idx,m);
+      uint8_t rank_val = getEncodedRank(encoded_hash_value, pPrime, p);
+      updateRegister(idx, rank_val);
+    });
 }
 
 
@@ -587,6 +1182,7 @@ void HyperLogLogPlusMinus<T>::merge(HyperLogLogPlusMinus<T>&& other) {
     if (this->n_observed == 0) {
       n_observed = other.n_observed;
       sparse = other.sparse;
+      packed = other.packed;
       sparseList = std::move(other.sparseList);
       M = std::move(other.M);
     } else {
@@ -594,23 +1190,20 @@ void HyperLogLogPlusMinus<T>::merge(HyperLogLogPlusMinus<T>&& other) {
       if (this->sparse && other.sparse) {
         // this->merge(static_cast<const HyperLogLogPlusMinus<T>&>(other));
         // consider using addHashToSparseList(this->sparseList, val, pPrime) and checking for sizes
-        this->sparseList.insert(other.sparseList.begin(), other.sparseList.end());
+        this->sparseList.insert(other.sparseList);
       } else if (other.sparse) {
         // other is sparse, but this is not
         addToRegisters(other.sparseList);
       } else {
         if (this->sparse) {
           this->sparse = false;
+          packed = other.packed;
           M = std::move(other.M);
           addToRegisters(this->sparseList);
           this->sparseList.clear();
         } else {
           // merge registers
-          for (size_t i = 0; i < other.M.size(); ++i) {
-            if (other.M[i] > this->M[i]) {
-              this->M[i] = other.M[i];
-           }
-          }
+          mergeRegisters(this->M, packed, other.M, other.packed, m);
         }
       }
     }
@@ -629,29 +1222,27 @@ void HyperLogLogPlusMinus<T>::merge(const HyperLogLogPlusMinus<T>& other) {
       // TODO: Make this more efficient when other is disowned
       n_observed = other.n_observed;
       sparse = other.sparse;
+      packed = other.packed;
       sparseList = other.sparseList;
       M = other.M;
     } else {
       n_observed += other.n_observed;
       if (this->sparse && other.sparse) {
         // consider using addHashToSparseList(this->sparseList, val, pPrime) and checking for sizes
-        this->sparseList.insert(other.sparseList.begin(), other.sparseList.end());
+        this->sparseList.insert(other.sparseList);
       } else if (other.sparse) {
         // other is sparse, but this is not
         addToRegisters(other.sparseList);
       } else {
         if (this->sparse) {
           this->sparse = false;
+          packed = other.packed;
           M = other.M;
           addToRegisters(this->sparseList);
           this->sparseList.clear();
         } else {
           // merge registers
-          for (size_t i = 0; i < other.M.size(); ++i) {
-            if (other.M[i] > this->M[i]) {
-              this->M[i] = other.M[i];
-            }
-          }
+          mergeRegisters(this->M, packed, other.M, other.packed, m);
         }
       }
     }
@@ -671,26 +1262,29 @@ HyperLogLogPlusMinus<T>& HyperLogLogPlusMinus<T>::operator+=(const HyperLogLogPl
 
 template<>
 uint64_t HyperLogLogPlusMinus<uint64_t>::flajoletCardinality(bool use_sparse_precision) const {
-    vector<uint8_t> M = this->M;
+    vector<uint32_t> C;
     if (sparse) {
       if (use_sparse_precision) {
         return round(linearCounting(mPrime, mPrime-uint32_t(sparseList.size())));
       } else{
         // For testing purposes. Put sparse list into a standard register
-        M = vector<uint8_t>(m, 0);
-        for (const auto& val : sparseList) {
+        RegisterVector M(m, 0);
+        sparseList.for_each([&](uint32_t val) {
           size_t idx = getIndex(val, p);
           assert_lt(idx,M.size());
           uint8_t rank_val = getEncodedRank(val, pPrime, p);
           if (rank_val > M[idx]) {
             M[idx] = rank_val;
           }
-        }
+        });
+        C = registerValueCounts(M, false, m);
       }
+    } else {
+      C = registerValueCounts(M, packed, m);
     }
-    double est = calculateRawEstimate(M);
+    double est = calculateRawEstimate(C, m);
     if (est <= 2.5*m) {
-      uint32_t v = countZeros(M);
+      uint32_t v = C[0];
       if (v > 0) 
         est = linearCounting(m, v);
     } /* else if (est > 1/30 * pow(2,64) {
@@ -723,7 +1317,7 @@ uint64_t HyperLogLogPlusMinus<uint64_t>::ertlCardinality() const {
     } else {
       q = 64 - p;
       m = this->m;
-      C = registerHistogram(M, q);
+      C = registerHistogram(registerValueCounts(M, packed, m), q);
     }
   
     D(cerr << "\n1. hist. q=" << q << "; m=" << m << endl;)
@@ -761,7 +1355,8 @@ uint64_t HyperLogLogPlusMinus<uint64_t>::heuleCardinality(bool correct_bias) con
 
     // use linear counting (lc) estimate if there are zeros in the matrix
     //  AND the lc estimate is smaller than an empirically defined threshold
-    uint32_t v = countZeros(M);
+    vector<uint32_t> C = registerValueCounts(M, packed, m);
+    uint32_t v = C[0];
     if (v != 0) {
       uint64_t lc_estimate = round(linearCounting(m, v));
       D(cerr << "linear counting estimate ("<<m<<","<<v<<"): " << lc_estimate << endl;)
@@ -776,7 +1371,7 @@ uint64_t HyperLogLogPlusMinus<uint64_t>::heuleCardinality(bool correct_bias) con
 
     // calculate raw estimate on registers
     //double est = alpha(m) * harmonicMean(M, m);
-    double est = calculateRawEstimate(M);
+    double est = calculateRawEstimate(C, m);
     D(cerr << "raw estimate: " << est << endl;)
     // correct for biases if estimate is smaller than 5m
     if (correct_bias && est <= double(m)*5.0) {
@@ -816,13 +1411,7 @@ inline uint64_t ranhash (uint64_t u) {
  * from https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
  */
 uint64_t murmurhash3_finalizer (uint64_t key)  {
-  key += 1; // murmurhash returns a hash value of 0 for the key 0 - avoid that.
-  key ^= key >> 33;
-  key *= 0xff51afd7ed558ccd;
-  key ^= key >> 33;
-  key *= 0xc4ceb9fe1a85ec53;
-  key ^= key >> 33;
-  return key;
+  return murmurhash3_mix(key);
 }
 
 /*
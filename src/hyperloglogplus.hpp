@@ -25,8 +25,10 @@
 #ifndef HYPERLOGLOGPLUS_H_
 #define HYPERLOGLOGPLUS_H_
 
+#include<cstdint>
 #include<vector>
-#include<unordered_set>
+#include<algorithm>
+#include<iostream>
 using namespace std;
 
 //#define HLL_DEBUG
@@ -41,17 +43,130 @@ using namespace std;
 // 64-bit Mixer/finalizer from MurMurHash3 https://github.com/aappleby/smhasher
 uint64_t murmurhash3_finalizer (uint64_t key);
 
+// Select the kernels for merging and estimating dense registers: AVX2 if
+// enable is true and the CPU supports it, scalar otherwise. AVX2 is selected
+// by default. Returns true if the AVX2 kernels are used.
+bool hll_use_simd_kernels(bool enable);
 
-// Heule et al. encode the sparse list with variable length encoding
-//   see section 5.3.2. This implementation just uses a sorted vector or unordered_set.
-typedef unordered_set<uint32_t> SparseListType;
-// Other possible SparseList types:
-// // typedef vector<uint32_t> SparseListType;
-// The sorted vector implementation is pretty inefficient currently, as the vector
-// is always kept sorted. 
-// //typedef unordered_set<uint32_t, NoHash<uint32_t> > SparseListType;
-// No real performance gain from using the hash value directly - and probably problems
-// with the bucket assignment, since unordered_set expects size_t hashes
+// Store the registers of dense sketches that are created afterwards with 6
+// bits instead of 8 bits each: 25% less memory, but slower updates and merges.
+// The default is false, or true if compiled with -DHLL_PACKED_REGISTERS.
+void hll_use_packed_registers(bool enable);
+
+
+// Sparse list of encoded hash values, see section 5.3.2 of Heule et al.
+// The distinct values are kept sorted, delta and varint encoded. New values
+// go into a small unsorted buffer that is merged into the list when full.
+class SparseList {
+public:
+  static const size_t BUFFER_SIZE = 128;
+
+  SparseList() : n_values(0) {}
+
+  void insert(uint32_t val) {
+    buffer.push_back(val);
+    if (buffer.size() >= BUFFER_SIZE)
+      flush();
+  }
+
+  // Add all values of other
+  void insert(const SparseList& other);
+
+  // Merge the buffer into the encoded list
+  void flush();
+
+  void clear();
+
+  // Number of distinct values
+  size_t size() const;
+
+  // Number of values not yet merged into the encoded list
+  size_t buffered() const { return buffer.size(); }
+
+  // Binary serialization; read throws std::runtime_error on malformed input
+  void write(ostream& os) const;
+  void read(istream& is);
+
+  // Call f on each distinct value, in increasing order
+  template<typename F>
+  void for_each(F f) const;
+
+private:
+  vector<uint8_t> encoded;  // varint encoded differences of sorted values
+  size_t n_values;          // number of values in encoded
+  vector<uint32_t> buffer;  // unsorted values, not yet in encoded
+
+  vector<uint32_t> decode() const;
+  void encode(const vector<uint32_t>& values);
+};
+
+template<typename F>
+void SparseList::for_each(F f) const {
+  vector<uint32_t> sorted_buffer(buffer);
+  std::sort(sorted_buffer.begin(), sorted_buffer.end());
+  auto buf_it = sorted_buffer.begin();
+
+  uint32_t val = 0;
+  bool have_last = false;
+  uint32_t last = 0;
+  size_t pos = 0;
+  for (size_t i = 0; i < n_values; ++i) {
+    uint32_t delta = 0;
+    for (uint8_t shift = 0; ; shift += 7) {
+      uint8_t byte = encoded[pos++];
+      delta |= uint32_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    val += delta;
+    for (; buf_it != sorted_buffer.end() && *buf_it <= val; ++buf_it) {
+      if (*buf_it != val && !(have_last && *buf_it == last)) {
+        f(*buf_it);
+        have_last = true; last = *buf_it;
+      }
+    }
+    f(val);
+    have_last = true; last = val;
+  }
+  for (; buf_it != sorted_buffer.end(); ++buf_it) {
+    if (!(have_last && *buf_it == last)) {
+      f(*buf_it);
+      have_last = true; last = *buf_it;
+    }
+  }
+}
+
+typedef SparseList SparseListType;
+
+// Storage for the registers of dense sketches. Register blocks are carved
+// from larger slabs and put on a free list of their size when released, so
+// that creating and destroying the many sketches of a classification and
+// report does not go through malloc each time. Slab memory is kept until exit.
+void* allocateRegisters(size_t n_bytes);
+void releaseRegisters(void* ptr, size_t n_bytes);
+
+template<typename T>
+struct RegisterAllocator {
+  typedef T value_type;
+
+  RegisterAllocator() {}
+  template<typename U>
+  RegisterAllocator(const RegisterAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(allocateRegisters(n * sizeof(T)));
+  }
+  void deallocate(T* ptr, size_t n) {
+    releaseRegisters(ptr, n * sizeof(T));
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const RegisterAllocator<T>&, const RegisterAllocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const RegisterAllocator<T>&, const RegisterAllocator<U>&) { return false; }
+
+typedef vector<uint8_t, RegisterAllocator<uint8_t> > RegisterVector;
 
 /**
  * HyperLogLogPlusMinus class for counting the number of unique 64-bit values in stream
@@ -63,10 +178,11 @@ class HyperLogLogPlusMinus {
 private:
   uint8_t p;      // precision, set in constructor
   size_t m = 1 << p;  // number of registers
-  vector<uint8_t> M;    // registers, size m
+  RegisterVector M;     // registers, size m (or 3m/4 bytes if packed)
   uint64_t n_observed = 0;
 
   bool sparse;          // sparse representation of the data?
+  bool packed;          // registers packed with 6 bits each?
   SparseListType sparseList;
   HASH (*bit_mixer) (uint64_t);
 
@@ -89,7 +205,9 @@ public:
 
   // Add items or other HLL to this sketch
   void add(uint64_t item);
-  void add(vector<uint64_t> items);
+  void add(const vector<uint64_t>& items);
+  // Add n_items items at once; faster than adding them one by one
+  void add(const uint64_t* items, size_t n_items);
 
   // Merge another sketch into this one
   // TODO: assumes equal bit_mixers! but does not check that
@@ -109,8 +227,17 @@ public:
 
   uint64_t nObserved() const;
 
+  // Binary serialization of precision, representation, n_observed and the
+  // sparse list or registers. The bit mixer is not stored - the sketch has
+  // to be read with the same bit mixer it was written with.
+  // read throws std::runtime_error on malformed input.
+  void write(ostream& os) const;
+  void read(istream& is);
+
 private:
   void switchToNormalRepresentation();
+  void addToSparseList(uint32_t encoded_hash_value);
+  void updateRegister(uint32_t idx, uint8_t rank);
   void addToRegisters(const SparseListType &sparseList);
 
 };
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KRAKEN_OUTPUT_HPP
+#define KRAKEN_OUTPUT_HPP
+
+#include "kraken_headers.hpp"
+
+/*
+ * Helpers for writing per-read classification output, as text or in the
+ * compact binary format.
+ *
+ * Binary format (all values uint32_t in host byte order, as the structs below
+ * are written directly; the output is read on a machine of the same order):
+ *   header:  "KRAKBIN1" flags reserved
+ *   per read: taxid seq_len n_runs n_hits
+ *             followed by n_runs (taxid, count) pairs if BINARY_OUTPUT_HITLISTS is set
+ * The read IDs are written to a separate text file (one per line, same order),
+ * so that the record file can be mmap'ed and scanned without parsing strings.
+ */
+
+namespace kraken {
+  // File type code for binary Kraken output
+  static const char * KRAKEN_BINARY_OUTPUT_STRING = "KRAKBIN1";
+
+  // Header flags
+  static const uint32_t BINARY_OUTPUT_HITLISTS = 1; // records are followed by hit runs
+  static const uint32_t BINARY_OUTPUT_QUICK = 2;    // classified in quick mode, n_hits is set
+
+  // Taxon code of a run of ambiguous k-mers ('A' in the text output)
+  static const uint32_t AMBIGUOUS_TAXON = (uint32_t)-1;
+
+  struct BinaryOutputHeader {
+    char magic[8];
+    uint32_t flags;
+    uint32_t reserved;
+  };
+
+  struct BinaryReadRecord {
+    uint32_t taxid;    // classification, 0 if unclassified
+    uint32_t seq_len;
+    uint32_t n_runs;   // number of BinaryHitRuns following the record
+    uint32_t n_hits;   // number of hits (quick mode only)
+  };
+
+  struct BinaryHitRun {
+    uint32_t taxid;
+    uint32_t count;
+  };
+
+  // Append the decimal representation of n to buf. Avoids the locale and
+  // stream state handling of operator<<, which is significant per read.
+  inline void append_uint(std::string &buf, uint64_t n) {
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    do {
+      *--p = '0' + (n % 10);
+      n /= 10;
+    } while (n);
+    buf.append(p, end - p);
+  }
+
+  template<typename T>
+  inline void append_raw(std::string &buf, const T &val) {
+    buf.append((const char *) &val, sizeof(T));
+  }
+}
+
+#endif
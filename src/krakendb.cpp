@@ -22,6 +22,7 @@
 #include "krakendb.hpp"
 #include "quickfile.hpp"
 #include <unordered_map>
+#include <algorithm>
 
 using std::string;
 using std::vector;
@@ -56,6 +57,13 @@ KrakenDB::KrakenDB() {
   _filesize = 0;
 }
 
+KrakenDB::KrakenDB(uint8_t k) : KrakenDB() {
+  this->k = k;
+  key_bits = k * 2;
+  key_len = key_bits / 8 + !! (key_bits % 8);
+  val_len = 4;
+}
+
 // Assumes ptr points to start of a readable mmap'ed file
 KrakenDB::KrakenDB(char *ptr, size_t filesize) {
   _filesize = filesize;
@@ -108,33 +116,133 @@ std::map<uint32_t,uint64_t> KrakenDB::count_taxons() {
 }
 
 
+static int max_threads() {
+  #ifdef _OPENMP
+  return omp_get_max_threads();
+  #else
+  return 1;
+  #endif
+}
+
+// In-place prefix sum: each thread sums its part of the array, and then
+// adds the sum of the parts before it while accumulating its part
+static void parallel_prefix_sum(uint64_t *arr, uint64_t n) {
+  int n_threads = max_threads();
+  vector<uint64_t> part_sums(n_threads + 1, 0);
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < n_threads; t++) {
+    uint64_t sum = 0;
+    for (uint64_t i = n * t / n_threads; i < n * (t + 1) / n_threads; i++)
+      sum += arr[i];
+    part_sums[t + 1] = sum;
+  }
+  for (int t = 0; t < n_threads; t++)
+    part_sums[t + 1] += part_sums[t];
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < n_threads; t++) {
+    uint64_t sum = part_sums[t];
+    for (uint64_t i = n * t / n_threads; i < n * (t + 1) / n_threads; i++) {
+      sum += arr[i];
+      arr[i] = sum;
+    }
+  }
+}
+
+// Pairs are indexed in blocks: the bin keys of a block are computed in
+// parallel and handed to the thread that owns their range of bins, which
+// then counts them, so that each key is read once by a single thread
+static const uint64_t INDEX_BLOCK_PAIRS = 1 << 24;
+
 // Creates an index, indicating starting positions of each bin
 // Bins contain k-mer/taxon pairs with k-mers that share a bin key
-void KrakenDB::make_index(string index_filename, uint8_t nt) {
+// If the pairs are already sorted by bin, the bin boundaries are found
+// with a single scan instead
+void KrakenDB::make_index(string index_filename, uint8_t nt, bool bin_sorted) {
   uint64_t entries = 1ull << (nt * 2);
-  vector<uint64_t> bin_counts(entries);
   char *ptr = get_pair_ptr();
-  #pragma omp parallel for schedule(dynamic,400)
-  for (uint64_t i = 0; i < key_ct; i++) {
-    uint64_t kmer = 0;
-    memcpy(&kmer, ptr + i * pair_size(), key_len);
-    uint64_t b_key = bin_key(kmer, nt);
-    #pragma omp atomic
-    bin_counts[b_key]++;
+  size_t pair_sz = pair_size();
+  int n_threads = max_threads();
+
+  QuickFile idx_file;
+  uint64_t *bin_offsets = create_index(idx_file, index_filename, nt);
+
+  if (bin_sorted) {
+    // Each thread takes a part of the pairs, and sets the offsets of the
+    // bins that start in it
+    bool sorted = true;
+    #pragma omp parallel for schedule(static,1) reduction(&&:sorted)
+    for (int t = 0; t < n_threads; t++) {
+      uint64_t begin = key_ct * t / n_threads;
+      uint64_t end = key_ct * (t + 1) / n_threads;
+      if (begin == end)
+        continue;
+      uint64_t kmer = 0;
+      uint64_t next_bin = 0;
+      if (begin > 0) {
+        memcpy(&kmer, ptr + (begin - 1) * pair_sz, key_len);
+        next_bin = bin_key(kmer, nt) + 1;
+      }
+      for (uint64_t i = begin; i < end && sorted; i++) {
+        memcpy(&kmer, ptr + i * pair_sz, key_len);
+        uint64_t b_key = bin_key(kmer, nt);
+        if (b_key + 1 < next_bin)
+          sorted = false;
+        while (next_bin <= b_key)
+          bin_offsets[next_bin++] = i;
+      }
+      if (end == key_ct) {
+        while (next_bin <= entries)
+          bin_offsets[next_bin++] = key_ct;
+      }
+    }
+    if (! sorted)
+      errx(EX_DATAERR, "database is not sorted by bin keys of length %u", (unsigned) nt);
+    return;
   }
 
-  uint64_t *bin_offsets = new uint64_t[ entries + 1 ];
+  // Count bins in bin_offsets[1..entries], and sum them up. parts[t * n_threads + o]
+  // has the bin keys that thread t computed in the bins of thread o.
+  uint64_t *bin_counts = bin_offsets + 1;
+  vector< vector<uint64_t> > parts(n_threads * n_threads);
+  for (uint64_t start = 0; start < key_ct; start += INDEX_BLOCK_PAIRS) {
+    uint64_t n = std::min(INDEX_BLOCK_PAIRS, key_ct - start);
+    char *block = ptr + start * pair_sz;
+    #pragma omp parallel for schedule(static,1)
+    for (int t = 0; t < n_threads; t++) {
+      vector<uint64_t> *thread_parts = &parts[t * n_threads];
+      for (int o = 0; o < n_threads; o++)
+        thread_parts[o].clear();
+      for (uint64_t i = n * t / n_threads; i < n * (t + 1) / n_threads; i++) {
+        uint64_t kmer = 0;
+        memcpy(&kmer, block + i * pair_sz, key_len);
+        uint64_t b_key = bin_key(kmer, nt);
+        thread_parts[(b_key * n_threads) >> (nt * 2)].push_back(b_key);
+      }
+    }
+    #pragma omp parallel for schedule(static,1)
+    for (int o = 0; o < n_threads; o++) {
+      for (int t = 0; t < n_threads; t++) {
+        const vector<uint64_t> &b_keys = parts[t * n_threads + o];
+        for (size_t i = 0; i < b_keys.size(); i++)
+          bin_counts[b_keys[i]]++;
+      }
+    }
+  }
   bin_offsets[0] = 0;
-  for (uint64_t i = 1; i <= entries; i++)
-    bin_offsets[i] = bin_offsets[i-1] + bin_counts[i-1];
+  parallel_prefix_sum(bin_counts, entries);
+}
 
-  QuickFile idx_file(index_filename, "w",
-    strlen(KRAKEN_INDEX2_STRING) + 1 + sizeof(*bin_offsets) * (entries + 1));
+// Creates an index file for bin keys of nt nucleotides, and returns its
+// (zeroed) array of bin offsets
+uint64_t *KrakenDB::create_index(QuickFile &idx_file, string index_filename, uint8_t nt) {
+  uint64_t entries = 1ull << (nt * 2);
+  idx_file.open_file(index_filename, "w",
+    strlen(KRAKEN_INDEX2_STRING) + 1 + sizeof(uint64_t) * (entries + 1));
   char *idx_ptr = idx_file.ptr();
   memcpy(idx_ptr, KRAKEN_INDEX2_STRING, strlen(KRAKEN_INDEX2_STRING));
   idx_ptr += strlen(KRAKEN_INDEX2_STRING);
   memcpy(idx_ptr++, &nt, 1);
-  memcpy(idx_ptr, bin_offsets, sizeof(*bin_offsets) * (entries + 1));
+  return (uint64_t *) idx_ptr;
 }
 
 // Simple accessor
@@ -166,6 +274,17 @@ uint64_t KrakenDB::get_key_ct() { return key_ct; }
 uint64_t KrakenDB::pair_size() { return key_len + val_len; }
 size_t KrakenDB::header_size() { return 72 + 2 * (4 + 8 * key_bits); }
 
+// Only the fields read by the constructor are set, the Jellyfish hash
+// matrices are left empty
+vector<char> KrakenDB::make_header(uint64_t key_ct) {
+  vector<char> header(header_size(), 0);
+  memcpy(header.data(), DATABASE_FILE_TYPE, strlen(DATABASE_FILE_TYPE));
+  memcpy(header.data() + 8, &key_bits, 8);
+  memcpy(header.data() + 16, &val_len, 8);
+  memcpy(header.data() + 48, &key_ct, 8);
+  return header;
+}
+
 // Bin key: each k-mer is made of several overlapping m-mers, m < k
 // The bin key is the m-mer whose canonical representation is "smallest"
 // ("smallest" can refer to lexico. ordering or some other ordering)
@@ -176,11 +295,18 @@ uint64_t KrakenDB::bin_key(uint64_t kmer, uint64_t idx_nt) {
   mask--;
   xor_mask &= mask;
   uint64_t min_bin_key = ~0;
+  // The reverse complement of each nt-mer is an nt-mer of the reverse
+  // complement of the k-mer, taken from the other end
+  uint64_t revcom = reverse_complement(kmer);
+  uint64_t revcom_shift = key_bits - nt * 2;
   for (uint64_t i = 0; i < key_bits / 2 - nt + 1; i++) {
-    uint64_t temp_bin_key = xor_mask ^ canonical_representation(kmer & mask, nt);
+    uint64_t fwd = kmer & mask;
+    uint64_t rev = (revcom >> revcom_shift) & mask;
+    uint64_t temp_bin_key = xor_mask ^ (fwd < rev ? fwd : rev);
     if (temp_bin_key < min_bin_key)
       min_bin_key = temp_bin_key;
     kmer >>= 2;
+    revcom_shift -= 2;
   }
   return min_bin_key;
 }
@@ -195,11 +321,16 @@ uint64_t KrakenDB::bin_key(uint64_t kmer) {
   mask--;
   xor_mask &= mask;
   uint64_t min_bin_key = ~0;
+  uint64_t revcom = reverse_complement(kmer);
+  uint64_t revcom_shift = key_bits - nt * 2;
   for (uint64_t i = 0; i < key_bits / 2 - nt + 1; i++) {
-    uint64_t temp_bin_key = xor_mask ^ canonical_representation(kmer & mask, nt);
+    uint64_t fwd = kmer & mask;
+    uint64_t rev = (revcom >> revcom_shift) & mask;
+    uint64_t temp_bin_key = xor_mask ^ (fwd < rev ? fwd : rev);
     if (temp_bin_key < min_bin_key)
       min_bin_key = temp_bin_key;
     kmer >>= 2;
+    revcom_shift -= 2;
   }
   return min_bin_key;
 }
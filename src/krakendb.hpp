@@ -23,8 +23,11 @@
 #include "kraken_headers.hpp"
 #include <unordered_map>
 #include <map>
+#include <vector>
 
 namespace kraken {
+  class QuickFile;
+
   class KrakenDBIndex {
     public:
     KrakenDBIndex();
@@ -82,7 +85,13 @@ namespace kraken {
     uint64_t canonical_representation(uint64_t kmer, uint8_t n);
     uint64_t canonical_representation(uint64_t kmer);
 
-    void make_index(std::string index_filename, uint8_t nt);
+    // bin_sorted: pairs are already sorted by bin, only find boundaries
+    void make_index(std::string index_filename, uint8_t nt,
+                    bool bin_sorted = false);
+
+    // open idx_file as a new index for nt, return its bin offsets array
+    static uint64_t *create_index(QuickFile &idx_file,
+                                  std::string index_filename, uint8_t nt);
 
     void set_index(KrakenDBIndex *i_ptr);
 
@@ -94,6 +103,12 @@ namespace kraken {
     // ptr points to start of mmap'ed DB in read or read/write mode
     KrakenDB(char *ptr, size_t filesize = 0);
 
+    // DB without pairs for k-mers of length k, to compute keys of a new DB
+    explicit KrakenDB(uint8_t k);
+
+    // Jellyfish header of a DB with key_ct pairs of this k and val_len
+    std::vector<char> make_header(uint64_t key_ct);
+
 
     private:
 
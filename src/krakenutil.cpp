@@ -109,9 +109,16 @@ namespace kraken {
 
 
 
+  uint32_t hit_count(const TaxonHitCounts &hit_counts, uint32_t taxon) {
+    auto it = lower_bound(hit_counts.begin(), hit_counts.end(), make_pair(taxon, (uint32_t)0));
+    if (it != hit_counts.end() && it->first == taxon)
+      return it->second;
+    return 0;
+  }
+
   // Tree resolution: take all hit taxa (plus ancestors), then
   // return leaf of highest weighted leaf-to-root path.
-  uint32_t resolve_tree(const unordered_map<uint32_t, uint32_t> &hit_counts,
+  uint32_t resolve_tree(const TaxonHitCounts &hit_counts,
                         const unordered_map<uint32_t, uint32_t> &parent_map) {
   
     set<uint32_t> max_taxa;
@@ -124,10 +131,7 @@ namespace kraken {
       uint32_t node = taxon;
       uint32_t score = 0;
       while (node > 0) {
-        auto it2 = hit_counts.find(node);
-        if (it2 != hit_counts.end()) {
-          score += it2->second;
-        }
+        score += hit_count(hit_counts, node);
         auto node_it = parent_map.find(node);
         if (node_it == parent_map.end()) {
           cerr << "No parent for " << node << " recorded" << endl;
@@ -167,6 +171,199 @@ namespace kraken {
 
 
 
+  // Taxa with IDs below this are looked up in an array, the rest in a hash map
+  static const uint32_t MAX_DENSE_TAXID = 1 << 23;
+
+  TaxonomyTree::TaxonomyTree(const unordered_map<uint32_t, uint32_t> &parent_map) {
+    // Number the taxa 1..n in taxon ID order, including parents without an
+    // entry of their own; 0 is the virtual root
+    vector<uint32_t> all_taxa;
+    all_taxa.reserve(parent_map.size() + 1);
+    all_taxa.push_back(0);
+    for (auto it = parent_map.begin(); it != parent_map.end(); ++it) {
+      if (it->first != 0)
+        all_taxa.push_back(it->first);
+      if (it->second != 0)
+        all_taxa.push_back(it->second);
+    }
+    sort(all_taxa.begin(), all_taxa.end());
+    all_taxa.erase(unique(all_taxa.begin(), all_taxa.end()), all_taxa.end());
+    size_t n = all_taxa.size();
+
+    unordered_map<uint32_t, uint32_t> index;
+    index.reserve(n);
+    for (size_t i = 1; i < n; ++i)
+      index[all_taxa[i]] = i;
+
+    // Roots, taxa with themselves as parent and taxa without a parent
+    // become children of the virtual root
+    vector<uint32_t> parent_index(n, 0);
+    for (size_t i = 1; i < n; ++i) {
+      auto it = parent_map.find(all_taxa[i]);
+      if (it != parent_map.end() && it->second != 0 && it->second != all_taxa[i])
+        parent_index[i] = index[it->second];
+    }
+
+    // Children lists, in taxon ID order
+    vector<uint32_t> child_starts(n + 1, 0);
+    for (size_t i = 1; i < n; ++i)
+      ++child_starts[parent_index[i] + 1];
+    for (size_t i = 0; i < n; ++i)
+      child_starts[i + 1] += child_starts[i];
+    vector<uint32_t> children(n);
+    vector<uint32_t> next_child(child_starts.begin(), child_starts.end() - 1);
+    for (size_t i = 1; i < n; ++i)
+      children[next_child[parent_index[i]]++] = i;
+
+    // Preorder traversal from the virtual root. Taxa on a parent cycle are
+    // not reached and treated as unknown.
+    vector<uint32_t> preorder(n, NO_NODE);
+    taxa.reserve(n);
+    parents.reserve(n);
+    depths.reserve(n);
+    vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+      uint32_t i = stack.back();
+      stack.pop_back();
+      uint32_t node = taxa.size();
+      preorder[i] = node;
+      taxa.push_back(i == 0 ? 1 : all_taxa[i]);
+      parents.push_back(i == 0 ? 0 : preorder[parent_index[i]]);
+      depths.push_back(i == 0 ? 0 : depths[parents.back()] + 1);
+      for (uint32_t c = child_starts[i + 1]; c > child_starts[i]; --c)
+        stack.push_back(children[c - 1]);
+    }
+
+    size_t n_nodes = taxa.size();
+    vector<uint32_t> subtree_sizes(n_nodes, 1);
+    for (size_t node = n_nodes - 1; node > 0; --node)
+      subtree_sizes[parents[node]] += subtree_sizes[node];
+    subtree_ends.resize(n_nodes);
+    for (size_t node = 0; node < n_nodes; ++node)
+      subtree_ends[node] = node + subtree_sizes[node];
+
+    uint32_t max_dense_taxon = 0;
+    for (size_t node = 1; node < n_nodes; ++node)
+      if (taxa[node] < MAX_DENSE_TAXID && taxa[node] > max_dense_taxon)
+        max_dense_taxon = taxa[node];
+    dense_nodes.assign(max_dense_taxon + 1, NO_NODE);
+    for (size_t node = 1; node < n_nodes; ++node) {
+      if (taxa[node] < MAX_DENSE_TAXID)
+        dense_nodes[taxa[node]] = node;
+      else
+        sparse_nodes[taxa[node]] = node;
+    }
+
+    // Sparse table over the shallowest node of each block
+    size_t n_blocks = ((n_nodes - 1) >> BLOCK_BITS) + 1;
+    block_minima.push_back(vector<uint32_t>(n_blocks));
+    for (size_t node = 0; node < n_nodes; ++node) {
+      size_t b = node >> BLOCK_BITS;
+      if ((node & ((1 << BLOCK_BITS) - 1)) == 0)
+        block_minima[0][b] = node;
+      else
+        block_minima[0][b] = shallower(block_minima[0][b], node);
+    }
+    for (size_t j = 1; ((size_t)1 << j) <= n_blocks; ++j) {
+      const vector<uint32_t> &prev = block_minima[j - 1];
+      vector<uint32_t> level(n_blocks - ((size_t)1 << j) + 1);
+      for (size_t b = 0; b < level.size(); ++b)
+        level[b] = shallower(prev[b], prev[b + ((size_t)1 << (j - 1))]);
+      block_minima.push_back(level);
+    }
+  }
+
+  uint32_t TaxonomyTree::node(uint32_t taxon) const {
+    if (taxon < dense_nodes.size())
+      return dense_nodes[taxon];
+    auto it = sparse_nodes.find(taxon);
+    return it == sparse_nodes.end() ? NO_NODE : it->second;
+  }
+
+  // Shallowest node in [first, last]
+  uint32_t TaxonomyTree::min_depth_node(uint32_t first, uint32_t last) const {
+    uint32_t first_block = first >> BLOCK_BITS, last_block = last >> BLOCK_BITS;
+    uint32_t best = first;
+    if (first_block == last_block) {
+      for (uint32_t node = first + 1; node <= last; ++node)
+        best = shallower(best, node);
+      return best;
+    }
+    for (uint32_t node = first + 1; node < (first_block + 1) << BLOCK_BITS; ++node)
+      best = shallower(best, node);
+    for (uint32_t node = last_block << BLOCK_BITS; node <= last; ++node)
+      best = shallower(best, node);
+    if (last_block - first_block > 1) {
+      uint32_t n_blocks = last_block - first_block - 1;
+      uint32_t j = 31 - __builtin_clz(n_blocks);
+      best = shallower(best, block_minima[j][first_block + 1]);
+      best = shallower(best, block_minima[j][last_block - (1 << j)]);
+    }
+    return best;
+  }
+
+  uint32_t TaxonomyTree::lca_node(uint32_t u, uint32_t v) const {
+    if (u == v)
+      return u;
+    if (u > v)
+      swap(u, v);
+    if (v < subtree_ends[u])
+      return u;
+    // the shallowest nodes after u up to v are children of the LCA
+    return parents[min_depth_node(u + 1, v)];
+  }
+
+  uint32_t TaxonomyTree::lca(uint32_t a, uint32_t b) const {
+    if (a == 0 || b == 0)
+      return a ? a : b;
+    if (a == b)
+      return a;
+    uint32_t u = node(a), v = node(b);
+    if (u == NO_NODE || v == NO_NODE)
+      return 1;
+    return taxa[lca_node(u, v)];
+  }
+
+  uint32_t TaxonomyTree::resolve_tree(const TaxonHitCounts &hit_counts) const {
+    // (taxon, score) of each hit taxon. Taxa not in the taxonomy only score
+    // their own hits.
+    vector<pair<uint32_t, uint32_t> > scores;
+    vector<pair<uint32_t, uint32_t> > hit_nodes;
+    scores.reserve(hit_counts.size());
+    hit_nodes.reserve(hit_counts.size());
+    for (auto it = hit_counts.begin(); it != hit_counts.end(); ++it) {
+      uint32_t u = node(it->first);
+      if (u == NO_NODE)
+        scores.push_back(*it);
+      else
+        hit_nodes.push_back(make_pair(u, it->second));
+    }
+
+    // Sum each taxon's LTR path: visit the hit nodes in preorder, keeping
+    // the hit ancestors of the current node and their path sums on a stack
+    sort(hit_nodes.begin(), hit_nodes.end());
+    vector<pair<uint32_t, uint32_t> > path;
+    for (auto it = hit_nodes.begin(); it != hit_nodes.end(); ++it) {
+      while (!path.empty() && subtree_ends[path.back().first] <= it->first)
+        path.pop_back();
+      uint32_t score = it->second + (path.empty() ? 0 : path.back().second);
+      path.push_back(make_pair(it->first, score));
+      scores.push_back(make_pair(taxa[it->first], score));
+    }
+
+    // If several LTR paths are tied for max, return LCA of all
+    uint32_t max_taxon = 0, max_score = 0;
+    for (auto it = scores.begin(); it != scores.end(); ++it) {
+      if (it->second > max_score) {
+        max_score = it->second;
+        max_taxon = it->first;
+      } else if (it->second == max_score) {
+        max_taxon = lca(max_taxon, it->first);
+      }
+    }
+    return max_taxon;
+  }
+
   uint8_t KmerScanner::k = 0;
   uint64_t KmerScanner::kmer_mask = 0;
   uint32_t KmerScanner::mini_kmer_mask = 0;
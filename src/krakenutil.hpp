@@ -33,12 +33,53 @@ namespace kraken {
   // Default ancestor is 1 (root of tree)
 uint32_t lca(const std::unordered_map<uint32_t, uint32_t> &parent_map, uint32_t a, uint32_t b);
 
+  // Per-read hit counts as (taxon, count) pairs, sorted by taxon
+  typedef std::vector<std::pair<uint32_t, uint32_t> > TaxonHitCounts;
 
+  // Return the count of taxon in hit_counts, 0 if absent
+  uint32_t hit_count(const TaxonHitCounts &hit_counts, uint32_t taxon);
 
   // Resolve classification tree
-  uint32_t resolve_tree(const std::unordered_map<uint32_t, uint32_t> &hit_counts,
+  uint32_t resolve_tree(const TaxonHitCounts &hit_counts,
                         const std::unordered_map<uint32_t, uint32_t> &parent_map);
 
+  // Immutable array representation of a taxonomy, built once from a parent
+  // map. Nodes are numbered in preorder below a virtual root standing for
+  // taxon 1, so that a subtree is a contiguous range of node numbers and the
+  // LCA of two nodes is the parent of the shallowest node between them.
+  class TaxonomyTree {
+    public:
+
+    TaxonomyTree() {}
+    explicit TaxonomyTree(const std::unordered_map<uint32_t, uint32_t> &parent_map);
+
+    // Same results as kraken::lca and kraken::resolve_tree on the parent map
+    uint32_t lca(uint32_t a, uint32_t b) const;
+    uint32_t resolve_tree(const TaxonHitCounts &hit_counts) const;
+
+    size_t size() const { return taxa.size(); }
+
+    private:
+    static const uint32_t NO_NODE = (uint32_t)-1;
+    static const uint32_t BLOCK_BITS = 5;  // depth minima are tabled per 32 nodes
+
+    uint32_t node(uint32_t taxon) const;
+    uint32_t lca_node(uint32_t u, uint32_t v) const;
+    uint32_t min_depth_node(uint32_t first, uint32_t last) const;
+    uint32_t shallower(uint32_t u, uint32_t v) const {
+      return depths[v] < depths[u] ? v : u;
+    }
+
+    std::vector<uint32_t> dense_nodes;  // taxon -> node for small taxon IDs
+    std::unordered_map<uint32_t, uint32_t> sparse_nodes;  // taxon -> node for the others
+    std::vector<uint32_t> taxa;          // node -> taxon
+    std::vector<uint32_t> parents;       // node -> parent node
+    std::vector<uint32_t> depths;        // node -> depth below the virtual root
+    std::vector<uint32_t> subtree_ends;  // node -> one past the last node in its subtree
+    // block_minima[j][b]: shallowest node in blocks b .. b+2^j-1
+    std::vector< std::vector<uint32_t> > block_minima;
+  };
+
   class KmerScanner {
     public:
 
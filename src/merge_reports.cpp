@@ -0,0 +1,144 @@
+/*
+ * Copyright 2017, Florian Breitwieser
+ *
+ * This file is part of the KrakenHLL taxonomic sequence classification system.
+ *
+ * KrakenHLL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenHLL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kraken_headers.hpp"
+#include "readcounts.hpp"
+#include "taxdb.hpp"
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+
+using namespace std;
+using namespace kraken;
+
+void usage(int exit_code) {
+  cerr << "Usage: merge_reports [options] <read counts file(s)>" << endl
+       << endl
+       << "Merges the taxon counts and k-mer sketches written by classify -R, e.g. of" << endl
+       << "runs on parts of a sample, and writes the Kraken report of the merged counts." << endl
+       << endl
+       << "Options: (*mandatory)" << endl
+       << "* -a filename      TaxDB" << endl
+       << "  -c filename      K-mer counts of a database (DB.counts), for the database" << endl
+       << "                   k-mer columns. Can be given multiple times" << endl
+       << "  -o filename      Output file for the report (default: stdout)" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
+
+int main(int argc, char **argv) {
+  string taxdb_file, report_file;
+  vector<string> db_counts_files;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:c:o:h")) != -1) {
+    switch (opt) {
+      case 'a' :
+        taxdb_file = optarg;
+        break;
+      case 'c' :
+        db_counts_files.push_back(optarg);
+        break;
+      case 'o' :
+        report_file = optarg;
+        break;
+      case 'h' :
+        usage(0);
+        break;
+      default:
+        usage(EX_USAGE);
+        break;
+    }
+  }
+  if (taxdb_file.empty()) {
+    cerr << "Missing mandatory option -a" << endl;
+    usage(EX_USAGE);
+  }
+  if (optind == argc) {
+    cerr << "No read counts files specified" << endl;
+    usage(EX_USAGE);
+  }
+
+  unordered_map<uint32_t, ReadCounts> taxon_counts;
+  bool have_precision = false;
+  bool exact_kmer_counts = false;
+  for (int i = optind; i < argc; ++i) {
+    ifstream ifs(argv[i], std::ios::binary);
+    if (!ifs)
+      err(EX_NOINPUT, "unable to open %s", argv[i]);
+    try {
+      ReadCountsHeader header = read_read_counts_header(ifs);
+      if (!have_precision) {
+        HLL_PRECISION = header.hll_precision;
+        exact_kmer_counts = header.flags & READ_COUNTS_EXACT;
+        have_precision = true;
+      } else if (header.hll_precision != HLL_PRECISION) {
+        errx(EX_DATAERR, "%s: k-mer sketch precision %u differs from %zu of the first file",
+             argv[i], header.hll_precision, HLL_PRECISION);
+      } else if (bool(header.flags & READ_COUNTS_EXACT) != exact_kmer_counts) {
+        errx(EX_DATAERR, "%s: cannot merge exact and HLL k-mer counts", argv[i]);
+      }
+      read_read_counts(ifs, header, taxon_counts);
+      if (ifs.peek() != std::ifstream::traits_type::eof())
+        errx(EX_DATAERR, "%s: trailing bytes after the last taxon", argv[i]);
+    } catch (const std::exception& e) {
+      errx(EX_DATAERR, "%s: %s", argv[i], e.what());
+    }
+  }
+  if (exact_kmer_counts)
+    cerr << "Warning: unique k-mers were counted exactly - their merged counts are sums over the files, "
+         << "and k-mers found in several files are counted multiple times." << endl;
+
+  TaxonomyDB<uint32_t> taxdb(taxdb_file, false);
+  for (size_t i = 0; i < db_counts_files.size(); ++i)
+    taxdb.readGenomeSizes(db_counts_files[i]);
+
+  ofstream ofs;
+  if (!report_file.empty()) {
+    ofs.open(report_file.c_str());
+    if (!ofs)
+      err(EX_CANTCREAT, "unable to open %s", report_file.c_str());
+  }
+  ostream& report_output = report_file.empty() ? cout : ofs;
+
+  TaxReport<uint32_t,ReadCounts> rep = TaxReport<uint32_t, ReadCounts>(report_output, taxdb, taxon_counts, false);
+  if (HLL_PRECISION > 0 || exact_kmer_counts) {
+    rep.setReportCols(vector<string> {
+      "%",
+      "reads",
+      "taxReads",
+      "kmers",
+      "dup",
+      "cov",
+      "taxID",
+      "rank",
+      "taxName"});
+  } else {
+    rep.setReportCols(vector<string> {
+      "%",
+      "reads",
+      "taxReads",
+      "taxID",
+      "rank",
+      "taxName"});
+  }
+  rep.printReport("kraken");
+
+  return 0;
+}
@@ -22,26 +22,43 @@
 
 #include "kraken_headers.hpp"
 #include "hyperloglogplus.hpp"
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace kraken {
   static size_t HLL_PRECISION = 14;
 
   struct ReadCounts {
     uint64_t n_reads;
-    // uint64_t n_kmers; // now in kmers.nObserved()
-    bool count_kmers = HLL_PRECISION == 0; // TODO: redo
-    HyperLogLogPlusMinus<uint64_t> kmers; // unique k-mer count per taxon
+    bool count_kmers;
+    // unique k-mer count per taxon; allocated with the first k-mer, so that
+    // taxa with only read counts do not carry a sketch
+    std::unique_ptr<HyperLogLogPlusMinus<uint64_t> > kmers;
+    // k-mer counts when not sketching; the number of unique k-mers is set
+    // from outside, e.g. from the database position bitmaps in classify
+    uint64_t n_kmers;
+    uint64_t n_unique_kmers;
 
-    ReadCounts() : n_reads(0), count_kmers(HLL_PRECISION > 0), kmers(HyperLogLogPlusMinus<uint64_t>(HLL_PRECISION)) {
+    // with HLL_PRECISION 0, k-mers are not sketched but counted in n_kmers
+    ReadCounts() : n_reads(0), count_kmers(HLL_PRECISION > 0), n_kmers(0), n_unique_kmers(0) {
     }
 
-    ReadCounts(const ReadCounts& other) : n_reads(other.n_reads), count_kmers(other.count_kmers), kmers(other.kmers) {
+    ReadCounts(const ReadCounts& other) : n_reads(other.n_reads), count_kmers(other.count_kmers),
+      kmers(other.kmers ? new HyperLogLogPlusMinus<uint64_t>(*other.kmers) : nullptr),
+      n_kmers(other.n_kmers), n_unique_kmers(other.n_unique_kmers) {
+    }
+
+    ReadCounts(ReadCounts&& other) : n_reads(other.n_reads), count_kmers(other.count_kmers),
+      kmers(std::move(other.kmers)), n_kmers(other.n_kmers), n_unique_kmers(other.n_unique_kmers) {
     }
 
     ReadCounts& operator=(const ReadCounts& other) {
       n_reads = other.n_reads;
       count_kmers =other.count_kmers;
-      kmers = other.kmers;
+      kmers.reset(other.kmers ? new HyperLogLogPlusMinus<uint64_t>(*other.kmers) : nullptr);
+      n_kmers = other.n_kmers;
+      n_unique_kmers = other.n_unique_kmers;
       return *this;
     }
 
@@ -49,33 +66,67 @@ namespace kraken {
       n_reads = other.n_reads;
       count_kmers =other.count_kmers;
       kmers = std::move(other.kmers);
+      n_kmers = other.n_kmers;
+      n_unique_kmers = other.n_unique_kmers;
       return *this;
     }
 
     void add_kmer(uint64_t kmer) {
-      if (count_kmers)
-        kmers.add(kmer);
+      if (count_kmers) {
+        if (!kmers)
+          kmers.reset(new HyperLogLogPlusMinus<uint64_t>(HLL_PRECISION));
+        kmers->add(kmer);
+      } else {
+        ++n_kmers;
+      }
     }
     
+    void add_kmers(const uint64_t* kmers_ptr, size_t n) {
+      if (count_kmers) {
+        if (!kmers)
+          kmers.reset(new HyperLogLogPlusMinus<uint64_t>(HLL_PRECISION));
+        kmers->add(kmers_ptr, n);
+      } else {
+        n_kmers += n;
+      }
+    }
+
+    // unique k-mers of different taxa are disjoint, so exact counts add up
     ReadCounts& operator+=(const ReadCounts& b) {
       n_reads += b.n_reads;
-      if (count_kmers)
-        kmers += b.kmers;
+      n_kmers += b.n_kmers;
+      n_unique_kmers += b.n_unique_kmers;
+      if (count_kmers && b.kmers) {
+        if (kmers)
+          *kmers += *b.kmers;
+        else
+          kmers.reset(new HyperLogLogPlusMinus<uint64_t>(*b.kmers));
+      }
       return *this;
     }
 
     ReadCounts& operator+=(ReadCounts&& b) {
       n_reads += b.n_reads;
-      if (count_kmers)
-        kmers += std::move(b.kmers);
+      n_kmers += b.n_kmers;
+      n_unique_kmers += b.n_unique_kmers;
+      if (count_kmers && b.kmers) {
+        if (kmers)
+          *kmers += std::move(*b.kmers);
+        else
+          kmers = std::move(b.kmers);
+      }
       return *this;
     }
 
+    uint64_t n_observed_kmers() const {
+      return kmers ? kmers->nObserved() : 0;
+    }
+
     bool operator<(const ReadCounts& rc) {
       if (n_reads < rc.n_reads) {
         return true;
       }
-      if (n_reads == rc.n_reads && kmers.nObserved() < rc.kmers.nObserved()) {
+      if (n_reads == rc.n_reads && n_observed_kmers() + n_kmers < rc.n_observed_kmers() + rc.n_kmers) {
         return true;
       }
       return false;
@@ -125,5 +176,87 @@ namespace kraken {
   uint64_t reads(const ReadCounts& read_count) {
     return(read_count.n_reads);
   }
+
+  uint64_t kmer_count(const ReadCounts& read_count) {
+    return(read_count.count_kmers ? read_count.n_observed_kmers() : read_count.n_kmers);
+  }
+
+  uint64_t unique_kmer_count(const ReadCounts& read_count) {
+    if (!read_count.count_kmers)
+      return read_count.n_unique_kmers;
+    return(read_count.kmers ? read_count.kmers->cardinality() : 0);
+  }
+
+  /*
+   * Binary file of the per-taxon counts of a classification (classify -R).
+   * The files of runs on parts of the data can be merged with merge_reports,
+   * as the k-mer sketches are included. All values are in host byte order, as
+   * the structs and integers are written directly, so the files are read on
+   * machines of the same byte order:
+   *   header:    "KRAKRC01" hll_precision(uint32) flags(uint32) n_taxa(uint64)
+   *   per taxon: taxid(uint32) n_reads n_kmers n_unique_kmers(uint64)
+   *              has_sketch(uint8), followed by the sketch if set
+   */
+  static const char * READ_COUNTS_FILE_STRING = "KRAKRC01";
+  static const uint32_t READ_COUNTS_EXACT = 1; // unique k-mers were counted exactly (classify -x)
+
+  struct ReadCountsHeader {
+    char magic[8];
+    uint32_t hll_precision;
+    uint32_t flags;
+    uint64_t n_taxa;
+  };
+
+  inline void write_read_counts(std::ostream& os, const std::unordered_map<uint32_t, ReadCounts>& taxon_counts, uint32_t flags) {
+    ReadCountsHeader header;
+    memcpy(header.magic, READ_COUNTS_FILE_STRING, sizeof(header.magic));
+    header.hll_precision = HLL_PRECISION;
+    header.flags = flags;
+    header.n_taxa = taxon_counts.size();
+    os.write((const char*) &header, sizeof(header));
+    for (const auto& it : taxon_counts) {
+      const ReadCounts& rc = it.second;
+      os.write((const char*) &it.first, sizeof(uint32_t));
+      os.write((const char*) &rc.n_reads, sizeof(uint64_t));
+      os.write((const char*) &rc.n_kmers, sizeof(uint64_t));
+      os.write((const char*) &rc.n_unique_kmers, sizeof(uint64_t));
+      uint8_t has_sketch = rc.kmers != nullptr;
+      os.write((const char*) &has_sketch, sizeof(uint8_t));
+      if (has_sketch)
+        rc.kmers->write(os);
+    }
+  }
+
+  // Reads the header of a read counts file; throws std::runtime_error if the
+  // file does not start with one
+  inline ReadCountsHeader read_read_counts_header(std::istream& is) {
+    ReadCountsHeader header;
+    if (!is.read((char*) &header, sizeof(header)) ||
+        strncmp(header.magic, READ_COUNTS_FILE_STRING, sizeof(header.magic)))
+      throw std::runtime_error("not a read counts file");
+    return header;
+  }
+
+  // Adds the counts of the n_taxa taxa following the header to taxon_counts.
+  // HLL_PRECISION has to be set to the precision of the file beforehand.
+  inline void read_read_counts(std::istream& is, const ReadCountsHeader& header,
+                               std::unordered_map<uint32_t, ReadCounts>& taxon_counts) {
+    for (uint64_t i = 0; i < header.n_taxa; ++i) {
+      uint32_t taxid;
+      ReadCounts rc;
+      uint8_t has_sketch;
+      if (!is.read((char*) &taxid, sizeof(uint32_t)) ||
+          !is.read((char*) &rc.n_reads, sizeof(uint64_t)) ||
+          !is.read((char*) &rc.n_kmers, sizeof(uint64_t)) ||
+          !is.read((char*) &rc.n_unique_kmers, sizeof(uint64_t)) ||
+          !is.read((char*) &has_sketch, sizeof(uint8_t)))
+        throw std::runtime_error("truncated read counts file");
+      if (has_sketch) {
+        rc.kmers.reset(new HyperLogLogPlusMinus<uint64_t>(header.hll_precision));
+        rc.kmers->read(is);
+      }
+      taxon_counts[taxid] += std::move(rc);
+    }
+  }
 }
 #endif
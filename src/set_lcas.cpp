@@ -27,6 +27,7 @@
 #include "uid_mapping.hpp"
 #include <unordered_map>
 #include <map>
+#include <memory>
 
 #define SKIP_LEN 50000
 
@@ -39,6 +40,9 @@ void process_files();
 void process_single_file();
 void process_file(string filename, uint32_t taxid);
 void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish, bool is_contaminant_taxid = false);
+void queue_set_lcas(uint32_t taxid, string &seq, bool is_contaminant_taxid = false);
+void add_kmers_to_chunk(uint32_t taxid, string &seq);
+void merge_chunk();
 
 int Num_threads = 1;
 string DB_filename, Index_filename,
@@ -59,16 +63,36 @@ bool Use_uids_instead_of_taxids = false;
 bool Output_UID_map_to_STDOUT = false;
 bool Pretend = false;
 
+// Sort-merge mode: the k-mers of the library are collected with their taxids
+// in chunks, which are sorted by bin and merged with the database bins in
+// order, instead of looking up each k-mer
+struct KmerTaxid {
+  uint64_t kmer;
+  uint32_t bin_key;
+  uint32_t taxid;
+};
+size_t Chunk_size = 0;
+vector<KmerTaxid> Chunk;
+
+// Bases of the sequences queued for set_lcas tasks since the reader last
+// waited for them (only used by the reading thread)
+const size_t MAX_QUEUED_BASES = 1 << 28;
+size_t Queued_bases = 0;
+
 string UID_map_filename;
 ofstream UID_map_file;
 
-uint32_t current_uid = 0;
 unordered_map<uint32_t, uint32_t> Parent_map;
+TaxonomyTree Taxonomy;
 //unordered_multimap<uint32_t, uint32_t> Children_map;
 //typedef std::_Rb_tree_iterator<std::pair<const std::set<unsigned int>, unsigned int> > map_it;
 //typedef std::_Rb_tree_iterator<std::pair<const std::vector<unsigned int>, unsigned int> > map_it;
-vector< const TaxidSet*  > UID_to_taxids_vec;
-map< TaxidSet, uint32_t> Taxids_to_UID_map;
+ConcurrentUidMapping UID_mapping;
+
+// Locks for updating values that are not 4-byte aligned (see update_value)
+bool Values_aligned = true;
+const size_t N_VALUE_LOCKS = 4096;
+omp_lock_t Value_locks[N_VALUE_LOCKS];
 
 unordered_map<string, uint32_t> ID_to_taxon_map;
 unordered_map<uint32_t, bool> SeqId_added;
@@ -135,10 +159,25 @@ int main(int argc, char **argv) {
   KrakenDBIndex db_index(idx_file.ptr());
   Database.set_index(&db_index);
 
+  Values_aligned = Database.pair_size() % 4 == 0 &&
+    ((uintptr_t) Database.get_pair_ptr() + Database.get_key_len()) % 4 == 0;
+  if (! Values_aligned && Num_threads > 1) {
+    for (size_t i = 0; i < N_VALUE_LOCKS; i++)
+      omp_init_lock(&Value_locks[i]);
+  }
+
+  if (Chunk_size > 0) {
+    if (db_index.indexed_nt() > 16)
+      errx(EX_USAGE, "sort-merge mode requires bin keys of at most 16 nt");
+    Chunk.reserve(Chunk_size);
+  }
+
   if (One_FASTA_file)
     process_single_file();
   else
     process_files();
+  if (! Chunk.empty())
+    merge_chunk();
 
   if (!Kmer_count_filename.empty()) {
     ofstream ofs(Kmer_count_filename.c_str());
@@ -161,6 +200,10 @@ int main(int argc, char **argv) {
     dat.clear();
   }
 
+  if (Use_uids_instead_of_taxids) {
+    cerr << "Writing " << UID_mapping.size() << " UIDs to " << UID_map_filename << " ..." << endl;
+    UID_mapping.write(UID_map_file);
+  }
   UID_map_file.close();
 
   // Write new TaxDB file if new taxids were added
@@ -264,6 +307,7 @@ void process_single_file() {
   cerr << "Processing FASTA files" << endl;
  
   ID_to_taxon_map = read_seqid_to_taxid_map(ID_to_taxon_map_filename, taxdb, Parent_map, Add_taxIds_for_Assembly, Add_taxIds_for_Sequences);
+  Taxonomy = TaxonomyTree(Parent_map);
 
   FastaReader reader(Multi_fasta_filename);
   DNASequence dna;
@@ -271,6 +315,11 @@ void process_single_file() {
   uint32_t seqs_skipped = 0;
   uint32_t seqs_no_taxid = 0;
 
+  // This thread reads the sequences, and the other threads of the team run
+  // the queued LCA tasks. The sort-merge mode collects the k-mers here and
+  // runs its own parallel regions.
+  #pragma omp parallel if(Chunk_size == 0)
+  #pragma omp single
   while (reader.is_valid()) {
     dna = reader.next_sequence();
     if (! reader.is_valid())
@@ -327,11 +376,12 @@ void process_single_file() {
     if (taxid) {
       if (Parent_map.find(taxid) == Parent_map.end() || taxdb.entries.find(taxid) == taxdb.entries.end()) {
         cerr << "Ignoring sequence for taxID " << taxid << " - not in taxDB\n";
+      } else if (Chunk_size > 0) {
+        add_kmers_to_chunk(taxid, dna.seq);
+        ++seqs_processed;
       } else {
-        #pragma omp parallel for schedule(dynamic)
-        for (size_t i = 0; i < dna.seq.size(); i += SKIP_LEN)
-          set_lcas(taxid, dna.seq, i, i + SKIP_LEN + Database.get_k() - 1, is_contaminant_taxid);
-         ++seqs_processed;
+        queue_set_lcas(taxid, dna.seq, is_contaminant_taxid);
+        ++seqs_processed;
       }
     } else {
       if (verbose) 
@@ -351,9 +401,12 @@ void process_files() {
   if (map_file.rdstate() & ifstream::failbit) {
     err(EX_NOINPUT, "can't open %s", File_to_taxon_map_filename.c_str());
   }
+  Taxonomy = TaxonomyTree(Parent_map);
   string line;
   uint32_t seqs_processed = 0;
 
+  #pragma omp parallel if(Chunk_size == 0)
+  #pragma omp single
   while (map_file.good()) {
     getline(map_file, line);
     if (line.empty())
@@ -379,9 +432,11 @@ void process_file(string filename, uint32_t taxid) {
   // single-fasta files.
   dna = reader.next_sequence();
 
-  #pragma omp parallel for schedule(dynamic)
-  for (size_t i = 0; i < dna.seq.size(); i += SKIP_LEN)
-    set_lcas(taxid, dna.seq, i, i + SKIP_LEN + Database.get_k() - 1);
+  if (Chunk_size > 0) {
+    add_kmers_to_chunk(taxid, dna.seq);
+    return;
+  }
+  queue_set_lcas(taxid, dna.seq);
 }
 
 //void process_sequence(DNASequence dna) {
@@ -389,6 +444,59 @@ void process_file(string filename, uint32_t taxid) {
   // Or maybe asembly_summary file?
 //}
 
+// New value of a pair with value val that is found in a sequence of taxid
+inline uint32_t lca_value(uint32_t taxid, uint32_t val, bool is_contaminant_taxid) {
+  if (!force_contaminant_taxid)
+    return Taxonomy.lca(taxid, val);
+  if (val == TID_CONTAMINANT1 || val == TID_CONTAMINANT2) {
+    // keep value
+    return val;
+  } else if (is_contaminant_taxid) {
+    // When force_contaminant_taxid is set, do not compute lca, but assign the taxid
+    // of the (last) sequence to k-mers
+    return taxid;
+  } else {
+    return Taxonomy.lca(taxid, val);
+  }
+}
+
+inline uint32_t new_value(uint32_t val, uint32_t taxid, bool is_contaminant_taxid) {
+  if (Use_uids_instead_of_taxids)
+    return UID_mapping.add_taxid(val, taxid);
+  return lca_value(taxid, val, is_contaminant_taxid);
+}
+
+// Threads may update the same pair at once. Values are set with a
+// compare-and-swap loop, which retries with the current value if another
+// thread changed it in between. A UID is only read by other threads after
+// its entry in UID_mapping is set.
+// The compare-and-swap needs 4-byte aligned values, and so pairs of a
+// multiple of 4 bytes: with 7-byte keys (k <= 28), a value may cross a
+// cache line, which makes the CPU take a split lock. Unaligned values are
+// instead updated under a lock chosen by their address.
+inline void update_value(uint32_t *val_ptr, uint32_t taxid, bool is_contaminant_taxid) {
+  if (! Values_aligned) {
+    uint32_t val, new_val;
+    omp_lock_t *lock = &Value_locks[((uintptr_t) val_ptr >> 4) % N_VALUE_LOCKS];
+    if (Num_threads > 1)
+      omp_set_lock(lock);
+    memcpy(&val, val_ptr, sizeof(val));
+    new_val = new_value(val, taxid, is_contaminant_taxid);
+    memcpy(val_ptr, &new_val, sizeof(new_val));
+    if (Num_threads > 1)
+      omp_unset_lock(lock);
+    return;
+  }
+  uint32_t val = __atomic_load_n(val_ptr, __ATOMIC_ACQUIRE);
+  uint32_t new_val;
+  do {
+    new_val = new_value(val, taxid, is_contaminant_taxid);
+    if (new_val == val)
+      return;
+  } while (!__atomic_compare_exchange_n(val_ptr, &val, new_val, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
 void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish, bool is_contaminant_taxid) {
   KmerScanner scanner(seq, start, finish);
   uint64_t *kmer_ptr;
@@ -410,26 +518,134 @@ void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish, bool is_
       continue;
     }
 
-    // TODO: Should I use pragma omp critical here?
-    if (Use_uids_instead_of_taxids) {
-      #pragma omp critical(new_uid)
-      *val_ptr = uid_mapping(Taxids_to_UID_map, UID_to_taxids_vec, taxid, *val_ptr, current_uid, UID_map_file);
-    } else {
-      if (!force_contaminant_taxid) {
-        *val_ptr = lca(Parent_map, taxid, *val_ptr);
-      } else {
-        if (*val_ptr == TID_CONTAMINANT1 || *val_ptr == TID_CONTAMINANT2) {
-          // keep value
-        } else if (is_contaminant_taxid) {
-          // When force_contaminant_taxid is set, do not compute lca, but assign the taxid
-          // of the (last) sequence to k-mers
-          *val_ptr = taxid;
-        } else {
-          *val_ptr = lca(Parent_map, taxid, *val_ptr);
+    update_value(val_ptr, taxid, is_contaminant_taxid);
+  }
+}
+
+// Queues the LCA updates of a sequence as tasks of SKIP_LEN bases, which are
+// run by any idle thread. The sequence is moved out of seq, and freed when
+// its last task is done. When the queued tasks hold more than
+// MAX_QUEUED_BASES bases, the reader waits for them to finish.
+// With several threads, the tasks run in any order: the taxid kept by -T for
+// k-mers of several contaminant sequences, and the UID numbers of -I, depend
+// on the order in which they are run. With one thread, the tasks are run
+// right away, in the order of the input.
+void queue_set_lcas(uint32_t taxid, string &seq, bool is_contaminant_taxid) {
+  shared_ptr<string> seq_ptr = make_shared<string>();
+  seq_ptr->swap(seq);
+  for (size_t i = 0; i < seq_ptr->size(); i += SKIP_LEN) {
+    #pragma omp task firstprivate(seq_ptr, i) if(Num_threads > 1)
+    set_lcas(taxid, *seq_ptr, i, i + SKIP_LEN + Database.get_k() - 1, is_contaminant_taxid);
+  }
+  Queued_bases += seq_ptr->size();
+  if (Queued_bases > MAX_QUEUED_BASES) {
+    #pragma omp taskwait
+    Queued_bases = 0;
+  }
+}
+
+// Collects the canonical k-mers of seq, and merges them with the database
+// whenever the chunk is full
+void add_kmers_to_chunk(uint32_t taxid, string &seq) {
+  KmerScanner scanner(seq);
+  uint64_t *kmer_ptr;
+  while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+    if (scanner.ambig_kmer())
+      continue;
+    KmerTaxid kt = { Database.canonical_representation(*kmer_ptr), 0, taxid };
+    Chunk.push_back(kt);
+    if (Chunk.size() == Chunk_size)
+      merge_chunk();
+  }
+}
+
+// Stable LSD radix sort of the chunk by bin key, on 8-bit digits. Each
+// thread counts the digits of its part of the chunk, and scatters it to
+// its own offsets.
+void sort_chunk_by_bin(vector<KmerTaxid> &chunk, int key_bits) {
+  size_t n = chunk.size();
+  vector<KmerTaxid> tmp(n);
+  vector< vector<size_t> > offsets(Num_threads, vector<size_t>(256));
+  for (int shift = 0; shift < key_bits; shift += 8) {
+    #pragma omp parallel for schedule(static,1)
+    for (int t = 0; t < Num_threads; t++) {
+      vector<size_t> &counts = offsets[t];
+      fill(counts.begin(), counts.end(), 0);
+      for (size_t i = n * t / Num_threads; i < n * (t + 1) / Num_threads; i++)
+        counts[(chunk[i].bin_key >> shift) & 0xFF]++;
+    }
+    size_t pos = 0;
+    for (int d = 0; d < 256; d++) {
+      for (int t = 0; t < Num_threads; t++) {
+        size_t count = offsets[t][d];
+        offsets[t][d] = pos;
+        pos += count;
+      }
+    }
+    #pragma omp parallel for schedule(static,1)
+    for (int t = 0; t < Num_threads; t++) {
+      vector<size_t> &pos = offsets[t];
+      for (size_t i = n * t / Num_threads; i < n * (t + 1) / Num_threads; i++)
+        tmp[pos[(chunk[i].bin_key >> shift) & 0xFF]++] = chunk[i];
+    }
+    chunk.swap(tmp);
+  }
+}
+
+// Sorts the chunk by bin, and goes through the bins of the database in
+// order. Each thread takes a part of the chunk that starts and ends at bin
+// boundaries, so no two threads update the same pair. The k-mers of a
+// taxid keep their order in the chunk.
+void merge_chunk() {
+  KrakenDBIndex *db_index = Database.get_index();
+  size_t n = Chunk.size();
+  cerr << "\rMerging " << n << " k-mers with the database ..." << endl;
+
+  #pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n; i++)
+    Chunk[i].bin_key = Database.bin_key(Chunk[i].kmer);
+  sort_chunk_by_bin(Chunk, db_index->indexed_nt() * 2);
+
+  vector<size_t> part_start(Num_threads + 1, n);
+  for (int t = 0; t < Num_threads; t++) {
+    size_t i = n * t / Num_threads;
+    while (i > 0 && i < n && Chunk[i].bin_key == Chunk[i-1].bin_key)
+      i++;
+    part_start[t] = i;
+  }
+
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < Num_threads; t++) {
+    uint64_t last_bin_key = 0;
+    int64_t bin_min = 0, bin_max = -1;
+    for (size_t i = part_start[t]; i < part_start[t+1]; i++) {
+      const KmerTaxid &kt = Chunk[i];
+      if (i == part_start[t] || kt.bin_key != last_bin_key) {
+        last_bin_key = kt.bin_key;
+        bin_min = db_index->at(last_bin_key);
+        bin_max = db_index->at(last_bin_key + 1) - 1;
+      }
+      int64_t min_pos = bin_min, max_pos = bin_max;
+      uint32_t *val_ptr = min_pos <= max_pos
+        ? Database.kmer_query(kt.kmer, &last_bin_key, &min_pos, &max_pos)
+        : NULL;
+      if (val_ptr == NULL) {
+        if (! Allow_extra_kmers) {
+          errx(EX_DATAERR, "kmer found in sequence that is not in database");
+        }
+        else if (verbose) {
+          #pragma omp critical(verbose_output)
+          cerr << "kmer found in sequence w/ taxid " << kt.taxid << " that is not in database" << endl;
         }
+        continue;
       }
+      // Only sequences of the multi-FASTA file may be contaminants
+      bool is_contaminant_taxid = One_FASTA_file &&
+        (kt.taxid == TID_CONTAMINANT1 || kt.taxid == TID_CONTAMINANT2);
+      update_value(val_ptr, kt.taxid, is_contaminant_taxid);
     }
   }
+  Chunk.clear();
 }
 
 void parse_command_line(int argc, char **argv) {
@@ -438,7 +654,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "f:d:i:t:n:m:F:xMTvb:aApI:o:Sc:")) != -1) {
+  while ((opt = getopt(argc, argv, "f:d:i:t:n:m:F:xMTvb:aApI:o:Sc:s:")) != -1) {
     switch (opt) {
       case 'f' :
         File_to_taxon_map_filename = optarg;
@@ -500,6 +716,12 @@ void parse_command_line(int argc, char **argv) {
       case 'p' :
         Pretend = true;
         break;
+      case 's' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive chunk size");
+        Chunk_size = sig * 1000000;
+        break;
       default:
         usage();
         break;
@@ -538,6 +760,8 @@ void usage(int exit_code) {
        << "  -T               Do not set LCA as taxid for kmers, but the taxid of the sequence" << endl
        << "  -I filename      Write UIDs into database, and output (binary) UID-to-taxid map to filename" << endl
        << "  -p               Pretend - do not write database back to disk (when working in RAM)" << endl
+       << "  -s #             Sort-merge mode: collect # million k-mers of the sequences at a time," << endl
+       << "                   sort them by bin and merge them with the database in one pass" << endl
        << "  -v               Verbose output" << endl
        << "  -h               Print this message" << endl
        << endl
@@ -286,13 +286,12 @@ class TaxReport {
     std::ostream& _reportOfb;
     const TaxonomyDB<TAXID> & _taxdb;
     const std::unordered_map<TAXID, READCOUNTS>& _taxCounts; // set in constructor, from classification
-    //std::unordered_map<const TaxonomyEntry<TAXID>*, vector<const TaxonomyEntry<TAXID>*> > _children;
-    std::unordered_map<const TaxonomyEntry<TAXID>*, vector<const READCOUNTS*> > _children;
+    std::unordered_map<const TaxonomyEntry<TAXID>*, vector<const TaxonomyEntry<TAXID>*> > _children; // children with counts in their clade
     std::unordered_map<const TaxonomyEntry<TAXID>*, READCOUNTS> _cladeCounts; // consider accessing by TaxEntry*
     uint64_t _total_n_reads = 0;
     bool _show_zeros;
     void printLine(const TaxonomyEntry<TAXID>& tax, const READCOUNTS& rc, unsigned depth);
-	READCOUNTS setCladeCounts(const TaxonomyEntry<TAXID>* tax, unordered_map<const TaxonomyEntry<TAXID>*, unordered_set<const TaxonomyEntry<TAXID>*> >& _children);
+    void setCladeCounts(const TaxonomyEntry<TAXID>* tax);
 
   public:
     TaxReport(std::ostream& _reportOfb, const TaxonomyDB<TAXID> & taxdb, const std::unordered_map<TAXID, READCOUNTS>&, bool _show_zeros);
@@ -943,33 +942,29 @@ void TaxonomyDB<TAXID>::readGenomeSizes(string file) {
    }
    */
 
-/*
+// Set the clade counts of tax after those of its children, which are
+// computed in parallel tasks. Requires all entries of _cladeCounts to exist.
 template<typename TAXID, typename READCOUNTS>
-READCOUNTS TaxReport<TAXID,READCOUNTS>::setCladeCounts(const TaxonomyEntry<TAXID>* tax, unordered_map<const TaxonomyEntry<TAXID>*, unordered_set<const TaxonomyEntry<TAXID>*> >& _children) {
-  auto itt = _taxCounts.find(tax->taxonomyID);
-  auto itc = _children.find(tax);
-  if (itc == _children.end()) {
-    //this is a leaf node, return its taxCounts
-    if (itt == _taxCounts.end()) {
-      // cerr << "This leaf node [taxid "<< tax->taxonomyID <<"] has no taxon count" << endl;
-      return(READCOUNTS());
-	}
-	_cladeCounts[tax] = itt->second;
-  } else {
-    auto c = itc->second.begin();
-
-  	READCOUNTS rc = setCladeCounts(*c, _children);
-
-	for (++c; c != itc->second.end(); ++c) {
-      rc += setCladeCounts(*c, _children);
-	}
-	if (itt != _taxCounts.end())
-      rc += itt->second;
+void TaxReport<TAXID,READCOUNTS>::setCladeCounts(const TaxonomyEntry<TAXID>* tax) {
+  const auto itc = _children.find(tax);
+  if (itc != _children.end()) {
+    for (auto c = itc->second.begin(); c != itc->second.end(); ++c) {
+      const TaxonomyEntry<TAXID>* child = *c;
+      #pragma omp task firstprivate(child) if(_children.count(child) > 0)
+      setCladeCounts(child);
+    }
+    #pragma omp taskwait
+  }
 
-	_cladeCounts[tax] = rc;
+  READCOUNTS& rc = _cladeCounts.at(tax);
+  const auto itt = _taxCounts.find(tax->taxonomyID);
+  if (itt != _taxCounts.end())
+    rc = itt->second;
+  if (itc != _children.end()) {
+    for (auto c = itc->second.begin(); c != itc->second.end(); ++c)
+      rc += _cladeCounts.at(*c);
   }
-  return _cladeCounts.at(tax);
-}*/
+}
 
 template<typename TAXID, typename READCOUNTS>
 TaxReport<TAXID,READCOUNTS>::TaxReport(std::ostream& reportOfb, const TaxonomyDB<TAXID>& taxdb, 
@@ -977,39 +972,33 @@ TaxReport<TAXID,READCOUNTS>::TaxReport(std::ostream& reportOfb, const TaxonomyDB
     bool show_zeros) : _reportOfb(reportOfb), _taxdb(taxdb), _taxCounts(readCounts), _show_zeros(show_zeros) {
 
   cerr << "Setting values in the taxonomy tree ...";
-  //unordered_map<const TaxonomyEntry<TAXID>*, unordered_set<const TaxonomyEntry<TAXID>*> > _children1;
+  // Insert every taxon with counts and its ancestors into _cladeCounts, and
+  // link each of them to its parent
+  vector<const TaxonomyEntry<TAXID>*> roots;
   for (auto it = _taxCounts.begin(); it != _taxCounts.end(); ++it) {
     auto tax_it = taxdb.entries.find(it->first);
     if (tax_it == taxdb.entries.end()) {
       cerr << "No entry for " << it->first << " in database!" << endl;
     } else {
       const TaxonomyEntry<TAXID>* tax = &(tax_it->second);
-      while (tax != NULL) {
-        _children[tax].push_back(&(it->second));
-        /*
-        auto res = (_children1[tax->parent]).insert(tax);
-        if (!res.second)
-          break;
-        */
+      while (tax != NULL && _cladeCounts.insert({tax, READCOUNTS()}).second) {
+        if (tax->parent == NULL)
+          roots.push_back(tax);
+        else
+          _children[tax->parent].push_back(tax);
         tax = tax->parent;
       }
     }
   }
 
-  //cerr << " Nr children: " << _children.size() << endl;
-
-  #pragma omp parallel for schedule(dynamic, 50)
-  for (size_t i = 0; i < _children.size(); ++i) {
-
-    auto cit = _children.begin();
-    advance(cit, i);
-    READCOUNTS rc = *(cit->second.front());
-    for (size_t j = 1; j < cit->second.size(); ++j)
-       rc += *(cit->second[j]);
-    //READCOUNTS rc = mergeReadCounts(cit->second);
-    #pragma omp critical(update_clade_counts)
-    {
-      _cladeCounts[cit->first] = std::move(rc);
+  // Post-order traversal, merging each clade into its parent once
+  #pragma omp parallel
+  #pragma omp single
+  {
+    for (size_t i = 0; i < roots.size(); ++i) {
+      const TaxonomyEntry<TAXID>* root = roots[i];
+      #pragma omp task firstprivate(root)
+      setCladeCounts(root);
     }
   }
   
@@ -1120,7 +1109,7 @@ void TaxReport<TAXID,READCOUNTS>::printLine(const TaxonomyEntry<TAXID>& tax, con
   const auto r_it = _taxCounts.find(tax.taxonomyID);
   const bool has_tax_data = r_it != _taxCounts.end();
 
-  long long unique_kmers_for_clade = rc.kmers.cardinality();
+  long long unique_kmers_for_clade = unique_kmer_count(rc);
   double genome_size = double(tax.genomeSize+tax.genomeSizeOfChildren);
 
   for (size_t i = 0; i< _report_cols.size(); ++i) {
@@ -1135,10 +1124,10 @@ void TaxReport<TAXID,READCOUNTS>::printLine(const TaxonomyEntry<TAXID>& tax, con
            //case REPORTCOLS::ABUNDANCE_LEN:  _reportOfb << 100*counts.abundance[1]; break;
       case REPORTCOLS::NUM_READS:        _reportOfb << (has_tax_data? reads(r_it->second) : 0); break;
       case REPORTCOLS::NUM_READS_CLADE:  _reportOfb << reads(rc); break;
-      case REPORTCOLS::NUM_UNIQUE_KMERS: _reportOfb << (has_tax_data? r_it->second.kmers.cardinality() : 0); break;
+      case REPORTCOLS::NUM_UNIQUE_KMERS: _reportOfb << (has_tax_data? unique_kmer_count(r_it->second) : 0); break;
       case REPORTCOLS::NUM_UNIQUE_KMERS_CLADE:  _reportOfb << unique_kmers_for_clade; break;
-      case REPORTCOLS::NUM_KMERS:        _reportOfb << (has_tax_data? r_it->second.kmers.nObserved() : 0); break;
-      case REPORTCOLS::NUM_KMERS_CLADE:  _reportOfb << rc.kmers.nObserved(); break;
+      case REPORTCOLS::NUM_KMERS:        _reportOfb << (has_tax_data? kmer_count(r_it->second) : 0); break;
+      case REPORTCOLS::NUM_KMERS_CLADE:  _reportOfb << kmer_count(rc); break;
       case REPORTCOLS::NUM_KMERS_IN_DATABASE: _reportOfb << tax.genomeSize; break;
       case REPORTCOLS::CLADE_KMER_COVERAGE: 
                 if (genome_size == 0) { 
@@ -1146,7 +1135,12 @@ void TaxReport<TAXID,READCOUNTS>::printLine(const TaxonomyEntry<TAXID>& tax, con
                 } else {
             _reportOfb << setprecision(4) << (unique_kmers_for_clade  / genome_size); 
                 }; break;
-      case REPORTCOLS::CLADE_KMER_DUPLICITY: _reportOfb << setprecision(3) << ( double(rc.kmers.nObserved()) / unique_kmers_for_clade ); break;
+      case REPORTCOLS::CLADE_KMER_DUPLICITY:
+                if (unique_kmers_for_clade == 0) {
+            _reportOfb << "NA";
+                } else {
+            _reportOfb << setprecision(3) << ( double(kmer_count(rc)) / unique_kmers_for_clade );
+                }; break;
       case REPORTCOLS::NUM_KMERS_IN_DATABASE_CLADE: _reportOfb << tax.genomeSize + tax.genomeSizeOfChildren; break;
                 //case REPORTCOLS::GENOME_SIZE: ; break;
                 //case REPORTCOLS::NUM_WEIGHTED_READS: ; break;
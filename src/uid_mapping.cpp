@@ -31,65 +31,122 @@ namespace kraken {
   //static size_t UID_BLOCK_SIZE=2*INT_SIZE;
   static uint32_t max_uid = -1;
 
-  uint32_t uid_mapping(
-      map< TaxidSet, uint32_t>& Taxids_to_UID_map, 
-      vector< const TaxidSet*  >& UID_to_taxids_vec, 
-      uint32_t taxid, 
-      uint32_t kmer_uid, 
-      uint32_t& current_uid,
-      ofstream& UID_map_file) {
-
-    vector<uint32_t> taxid_set;
-    if (kmer_uid == 0) {
-      taxid_set.push_back(taxid);
-    } else {
-      if (kmer_uid > UID_to_taxids_vec.size()) {
-        // This can happen when set_lcas is called more than once on a database (ie not all values start w/ 0)
-        cerr << "kmer_uid ("<< kmer_uid <<") greater than UID vector size ("<< UID_to_taxids_vec.size()<<")!!" << endl;
-        exit(1);
-      }
-      taxid_set = *(UID_to_taxids_vec[kmer_uid-1]);
-      auto it = std::lower_bound( taxid_set.begin(), taxid_set.end(), taxid); // find proper position in descending order
-      if (it == taxid_set.end() || *it != taxid) {
-        // add the taxid to the set, in the right position such that it remains sorted
-         taxid_set.insert( it, taxid ); // insert before iterator it
-      } else {
-        // the taxid is already part of the set for kmer_uid, return kmer_uid
-        return kmer_uid;
-      }
+  static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  size_t ConcurrentUidMapping::TaxidSetHash::operator()(const TaxidSet& taxids) const {
+    uint64_t h = taxids.size();
+    for (size_t i = 0; i < taxids.size(); ++i)
+      h = (h ^ taxids[i]) * 0x100000001b3ULL;
+    return mix64(h);
+  }
+
+  ConcurrentUidMapping::ConcurrentUidMapping() :
+    blocks((size_t(1) << 32) >> BLOCK_BITS, NULL), n_uids(0) {
+    for (size_t i = 0; i < N_SHARDS; ++i)
+      omp_init_lock(&shards[i].lock);
+  }
+
+  ConcurrentUidMapping::~ConcurrentUidMapping() {
+    for (size_t i = 0; i < N_SHARDS; ++i)
+      omp_destroy_lock(&shards[i].lock);
+    for (size_t i = 0; i < blocks.size(); ++i)
+      delete[] blocks[i];
+  }
+
+  const ConcurrentUidMapping::UidEntry& ConcurrentUidMapping::entry(uint32_t uid) const {
+    const UidEntry* block = __atomic_load_n(&blocks[(uid-1) >> BLOCK_BITS], __ATOMIC_ACQUIRE);
+    return block[(uid-1) & ((1 << BLOCK_BITS) - 1)];
+  }
+
+  void ConcurrentUidMapping::set_entry(uint32_t uid, const UidEntry& e) {
+    UidEntry** block_ptr = &blocks[(uid-1) >> BLOCK_BITS];
+    UidEntry* block = __atomic_load_n(block_ptr, __ATOMIC_ACQUIRE);
+    if (block == NULL) {
+      UidEntry* new_block = new UidEntry[1 << BLOCK_BITS];
+      if (__atomic_compare_exchange_n(block_ptr, &block, new_block, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        block = new_block;
+      else
+        delete[] new_block;
     }
+    block[(uid-1) & ((1 << BLOCK_BITS) - 1)] = e;
+  }
 
-    // This taxid is not part of kmer_uids set, but is this new taxon_set already assigned to another UID?
-    // Try inserting ..
-    auto insert_res = Taxids_to_UID_map.insert( { std::move(taxid_set), current_uid + 1 } );
-    if (!insert_res.second) {
-      // Insert unsuccessful, taxid set already has an UID
-      return insert_res.first->second;
+  uint32_t ConcurrentUidMapping::add_taxid(uint32_t kmer_uid, uint32_t taxid) {
+    const TaxidSet* kmer_taxids = NULL;
+    if (kmer_uid != 0) {
+      if (kmer_uid > size())
+        errx(EX_DATAERR, "k-mer UID %u is greater than the number of UIDs %u", kmer_uid, size());
+      kmer_taxids = entry(kmer_uid).taxids;
+      if (std::binary_search(kmer_taxids->begin(), kmer_taxids->end(), taxid))
+        return kmer_uid;
     }
 
-    // Get a new UID
-    if (max_uid <= ++current_uid) {
-      cerr << "Maxxed out on UIDs!!" << endl;
-      exit(1);
+    uint64_t edge = (uint64_t(kmer_uid) << 32) | taxid;
+    Shard& edge_shard = shards[mix64(edge) % N_SHARDS];
+    uint32_t uid = 0;
+    omp_set_lock(&edge_shard.lock);
+    auto edge_it = edge_shard.edge_uids.find(edge);
+    if (edge_it != edge_shard.edge_uids.end())
+      uid = edge_it->second;
+    omp_unset_lock(&edge_shard.lock);
+    if (uid != 0)
+      return uid;
+
+    TaxidSet taxid_set;
+    if (kmer_taxids != NULL) {
+      taxid_set.reserve(kmer_taxids->size() + 1);
+      auto it = std::lower_bound(kmer_taxids->begin(), kmer_taxids->end(), taxid);
+      taxid_set.insert(taxid_set.end(), kmer_taxids->begin(), it);
+      taxid_set.push_back(taxid);
+      taxid_set.insert(taxid_set.end(), it, kmer_taxids->end());
+    } else {
+      taxid_set.push_back(taxid);
     }
 
-    UID_to_taxids_vec.push_back( &(insert_res.first->first) );
-    assert(UID_to_taxids_vec.size() == current_uid);
+    // The entry of a new UID is set before the lock is released, so it can
+    // be read by any thread that gets the UID from the maps
+    Shard& set_shard = shards[TaxidSetHash()(taxid_set) % N_SHARDS];
+    omp_set_lock(&set_shard.lock);
+    auto insert_res = set_shard.set_uids.insert( { std::move(taxid_set), 0 } );
+    if (insert_res.second) {
+      uid = __atomic_add_fetch(&n_uids, 1, __ATOMIC_RELAXED);
+      if (uid == max_uid)
+        errx(EX_SOFTWARE, "Maxxed out on UIDs!!");
+      UidEntry e = { &insert_res.first->first, taxid, kmer_uid };
+      set_entry(uid, e);
+      insert_res.first->second = uid;
+    } else {
+      uid = insert_res.first->second;
+    }
+    omp_unset_lock(&set_shard.lock);
 
-    // Write to mapping file
-    // format: TAXID<uint32_t> PARENT<uint32_t>
-    // read it with read_uid_mapping
-    UID_map_file.write((char*)&taxid, sizeof(taxid));
-    UID_map_file.write((char*)&kmer_uid, sizeof(kmer_uid));
+    omp_set_lock(&edge_shard.lock);
+    edge_shard.edge_uids.insert( { edge, uid } );
+    omp_unset_lock(&edge_shard.lock);
+    return uid;
+  }
 
-    return current_uid;
-  } // end of uid_mapping
+  void ConcurrentUidMapping::write(ofstream& UID_map_file) const {
+    uint32_t n = size();
+    for (uint32_t uid = 1; uid <= n; ++uid) {
+      const UidEntry& e = entry(uid);
+      UID_map_file.write((char*)&e.taxid, sizeof(e.taxid));
+      UID_map_file.write((char*)&e.parent_uid, sizeof(e.parent_uid));
+    }
+  }
 
 
   // Tree resolution: take all hit taxa (plus ancestors), then
   // return leaf of highest weighted leaf-to-root path.
   uint32_t resolve_uids(
-      const unordered_map<uint32_t, uint32_t> &uid_hit_counts,
+      const TaxonHitCounts &uid_hit_counts,
       const unordered_map<uint32_t, uint32_t> &parent_map,
       const vector< vector<uint32_t> > &UID_to_taxids_vec) {
     unordered_map<uint32_t, uint32_t> taxid_counts;
@@ -142,7 +199,7 @@ namespace kraken {
   // Tree resolution: take all hit taxa (plus ancestors), then
   // return leaf of highest weighted leaf-to-root path.
   uint32_t resolve_uids2(
-      const unordered_map<uint32_t, uint32_t> &uid_hit_counts,
+      const TaxonHitCounts &uid_hit_counts,
       const unordered_map<uint32_t, uint32_t> &parent_map,
       const char* fptr, const size_t fsize) {
 
@@ -210,7 +267,7 @@ namespace kraken {
   // This version saves observed mappings in a map
   // Doesn't seem to give big runtime improvements I've hope for, so far 
   uint32_t resolve_uids3(
-      const unordered_map<uint32_t, uint32_t> &uid_hit_counts,
+      const TaxonHitCounts &uid_hit_counts,
       const unordered_map<uint32_t, uint32_t> &parent_map,
       unordered_map<uint32_t, vector<uint32_t> > &uid_dict,
       const char* fptr, const size_t fsize) {
@@ -273,6 +330,94 @@ namespace kraken {
     return max_taxon;
   }
 
+
+  UidTaxidTable::UidTaxidTable(const char* fptr, const size_t fsize) {
+    // Each UID's set is its own taxid followed by the set of its parent UID,
+    // which always comes earlier in the file
+    size_t n_uids = fsize / (2*sizeof(uint32_t));
+    const uint32_t* blocks = (const uint32_t*)fptr;
+    nodes.resize(n_uids);
+    for (size_t i = 0; i < n_uids; ++i) {
+      uint32_t parent_uid = blocks[2*i+1];
+      if (parent_uid > i)
+        errx(EX_DATAERR, "UID %lu has parent UID %u that is not defined before it", (unsigned long)(i+1), parent_uid);
+      UidNode node = { blocks[2*i], parent_uid, parent_uid ? nodes[parent_uid-1].depth + 1 : 1 };
+      nodes[i] = node;
+    }
+  }
+
+  // Same as resolve_uids3, with the taxids of the UIDs from a precomputed table
+  uint32_t resolve_uids4(
+      const TaxonHitCounts &uid_hit_counts,
+      const TaxonomyTree &taxonomy,
+      const UidTaxidTable &uid_taxids) {
+
+    // (taxid, count, fractional count) for each taxid of each hit UID
+    struct TaxidHit {
+      uint32_t taxid;
+      uint32_t count;
+      double frac_count;
+      bool operator<(const TaxidHit &b) const { return taxid < b.taxid; }
+    };
+    vector<TaxidHit> hits;
+
+    for (auto it = uid_hit_counts.begin(); it != uid_hit_counts.end(); ++it) {
+      uint32_t uid = it->first;
+      if (uid == 0) {
+        continue;
+      }
+      if (uid > uid_taxids.size()) {
+        cerr << "UID " << uid << " is not in the UID mapping file!" << endl;
+        continue;
+      }
+      double frac_count = (double)it->second / (double)uid_taxids.set_size(uid);
+      for (uint32_t u = uid; u != 0; u = uid_taxids.parent_uid(u)) {
+        TaxidHit hit = { uid_taxids.taxid(u), it->second, frac_count };
+        hits.push_back(hit);
+      }
+    }
+
+    if (hits.empty()) {
+      return(0);
+    }
+
+    // Sum the counts per taxid; the stable sort keeps the order in which
+    // the fractional counts are added
+    std::stable_sort(hits.begin(), hits.end());
+    vector<uint32_t> max_taxids;
+    uint32_t max_count = 0;
+    double max_frac_count = 0;
+    for (size_t i = 0; i < hits.size(); ) {
+      uint32_t taxid = hits[i].taxid;
+      uint32_t count = 0;
+      double frac_count = 0;
+      for (; i < hits.size() && hits[i].taxid == taxid; ++i) {
+        count += hits[i].count;
+        frac_count += hits[i].frac_count;
+      }
+      if (count == max_count) {
+        if (frac_count == max_frac_count) {
+          max_taxids.push_back(taxid);
+        } else if (frac_count > max_frac_count) {
+          max_frac_count = frac_count;
+          max_taxids = { taxid };
+        }
+      } else if (count > max_count) {
+        max_taxids = { taxid };
+        max_count = count;
+        max_frac_count = frac_count;
+      }
+    }
+
+    uint32_t max_taxon = max_taxids[0];
+    for (size_t i = 1; i < max_taxids.size(); ++i) {
+      max_taxon = taxonomy.lca(max_taxon, max_taxids[i]);
+    }
+
+    // return the taxid that appeared most often
+    return max_taxon;
+  }
+
 }
 
 vector<uint32_t> get_taxids_for_uid(const uint32_t uid, const char* fptr) {
@@ -24,50 +24,110 @@
 #include<map>
 #include<unordered_map>
 #include<fstream>
+#include "krakenutil.hpp"
 using namespace std;
 
 
-// Takes the current UID kmer_uid, and checks whether
-// - taxid is in taxon set T specified in UID_to_taxids_vec[kmer_uid]?
-//   - yes: return kmer_uid
-//   - no: is there a set (T,taxid) in Taxids_to_UID_map?
-//     - yes: return the uid of that set
-//     - no:  
-//       - increment current_uid by one and set this as the set uid
-//       - add the set to Taxids_to_UID_map and UID_to_taxids_vec
-//       - write the mapping to UID_map_file
-//
-
 //using TaxidSet = typename std::vector<uint32_t>;
 typedef std::vector<uint32_t> TaxidSet;
 
 namespace kraken {
 
 
-uint32_t uid_mapping(
-      map< TaxidSet, uint32_t>& Taxids_to_UID_map, 
-      vector< const TaxidSet* >& UID_to_taxids_vec, 
-      uint32_t taxid, 
-      uint32_t kmer_uid, 
-      uint32_t& current_uid,
-      ofstream& UID_map_file);
+// Assigns a UID to each set of taxids that a k-mer is found in. Adding a
+// taxid to the set of a k-mer UID returns the same UID if the taxid is in
+// the set, the UID of the extended set if it has one, or a new UID.
+// A UID is defined by its parent UID and the added taxid, and these edges
+// are looked up first; only a new edge looks up the full taxid set, so each
+// set still gets a single UID.
+// Edges and sets are kept in shards with their own lock, UIDs are taken from
+// an atomic counter, and the taxid set of a UID is read without locking.
+class ConcurrentUidMapping {
+  public:
+  ConcurrentUidMapping();
+  ~ConcurrentUidMapping();
+
+  // UID of the set of kmer_uid with taxid added (kmer_uid 0 is the empty set)
+  uint32_t add_taxid(uint32_t kmer_uid, uint32_t taxid);
+
+  uint32_t size() const { return __atomic_load_n(&n_uids, __ATOMIC_RELAXED); }
+
+  // Writes the taxid and parent UID of each UID, as read by read_uid_mapping
+  void write(ofstream& UID_map_file) const;
+
+  private:
+  ConcurrentUidMapping(const ConcurrentUidMapping&);
+  ConcurrentUidMapping& operator=(const ConcurrentUidMapping&);
+
+  struct UidEntry {
+    const TaxidSet* taxids;
+    uint32_t taxid;
+    uint32_t parent_uid;
+  };
+  struct TaxidSetHash {
+    size_t operator()(const TaxidSet& taxids) const;
+  };
+  struct Shard {
+    omp_lock_t lock;
+    unordered_map<uint64_t, uint32_t> edge_uids;
+    unordered_map<TaxidSet, uint32_t, TaxidSetHash> set_uids;
+  };
+
+  static const size_t N_SHARDS = 256;
+  static const size_t BLOCK_BITS = 16;
+
+  const UidEntry& entry(uint32_t uid) const;
+  void set_entry(uint32_t uid, const UidEntry& e);
+
+  Shard shards[N_SHARDS];
+  vector<UidEntry*> blocks;  // entries of the UIDs, in blocks of 2^BLOCK_BITS
+  uint32_t n_uids;
+};
 
 
 uint32_t resolve_uids(
-      const unordered_map<uint32_t, uint32_t> &uid_hit_counts,
+      const TaxonHitCounts &uid_hit_counts,
       const unordered_map<uint32_t, uint32_t> &parent_map,
       const vector< vector<uint32_t> > &UID_to_taxids_vec);
 
 uint32_t resolve_uids2(
-      const unordered_map<uint32_t, uint32_t> &uid_hit_counts,
+      const TaxonHitCounts &uid_hit_counts,
       const unordered_map<uint32_t, uint32_t> &parent_map,
       const char* fptr, const size_t fsize);
 
 uint32_t resolve_uids3(
-      const unordered_map<uint32_t, uint32_t> &uid_hit_counts,
+      const TaxonHitCounts &uid_hit_counts,
       const unordered_map<uint32_t, uint32_t> &parent_map,
       unordered_map<uint32_t, vector<uint32_t> > &uid_dict,
       const char* fptr, const size_t fsize);
+
+// Taxid, parent UID and taxid set size of all UIDs in a UID mapping file.
+// The taxids of a UID are found by following its parent UIDs (in the order
+// of get_taxids_for_uid), so the table takes 12 bytes per UID. Built once
+// and read-only afterwards, so it can be shared between threads.
+class UidTaxidTable {
+  public:
+  UidTaxidTable() {}
+  UidTaxidTable(const char* fptr, const size_t fsize);
+
+  size_t size() const { return nodes.size(); }
+  uint32_t taxid(uint32_t uid) const { return nodes[uid-1].taxid; }
+  uint32_t parent_uid(uint32_t uid) const { return nodes[uid-1].parent_uid; }
+  uint32_t set_size(uint32_t uid) const { return nodes[uid-1].depth; }
+
+  private:
+  struct UidNode {
+    uint32_t taxid;
+    uint32_t parent_uid;
+    uint32_t depth;  // number of taxids of the UID
+  };
+  vector<UidNode> nodes;
+};
+
+uint32_t resolve_uids4(
+      const TaxonHitCounts &uid_hit_counts,
+      const TaxonomyTree &taxonomy,
+      const UidTaxidTable &uid_taxids);
 }
 
 vector<uint32_t> get_taxids_for_uid(const uint32_t uid, const char* fptr);